@@ -5,22 +5,106 @@
 #define _BSD_SOURCE
 #define _GNU_SOURCE
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*** defines ***/
 
 #define NEXTE_VERSION "0.0.1"
 #define NEXTE_TAB_STOP 8
+#define NEXTE_QUIT_TIMES 3
+#define NEXTE_STATUS_MSG_MS 5000
+
+// Longest a search may run before returning to the input loop (8 ms keeps
+// typing responsive; the scan resumes where it stopped between keys)
+#define NEXTE_SEARCH_SLICE_NS (8 * 1000000LL)
+
+// Lazy regex DFA: most states cached per DFA before it starts over, and
+// how many compiled patterns the search prompt keeps around
+#define NEXTE_RX_DFA_STATES 1024
+#define NEXTE_RX_CACHE 8
+
+// Rows longer than this many bytes aren't rendered whole: only the columns
+// on screen are, found from a checkpoint every NEXTE_LONG_STEP bytes
+#define NEXTE_LONG_ROW (1 << 16)
+#define NEXTE_LONG_STEP 1024
+
+// Rows of up to this many bytes keep their text (and its NUL) in the row
+// itself rather than in a block of their own
+#define NEXTE_ROW_INLINE 15
+
+// Soft wrap: rows per block of the screen line index
+#define NEXTE_WRAP_BLOCK 1024
+
+// Background highlighting: rows lexed between checks of the viewport
+#define NEXTE_HL_BATCH 1024
+
+// Find all: rows handed to a worker at a time, matches a worker collects
+// before publishing them, and the most positions kept (the count goes on)
+#define NEXTE_FINDALL_CHUNK 4096
+#define NEXTE_FINDALL_BATCH 1024
+#define NEXTE_FINDALL_MAX_STORED (1 << 24)
+#define NEXTE_FINDALL_MAX_THREADS 16
+
+// Undo log: arena chunk size, the most memory the log may use before the
+// oldest edits are dropped, and the longest run of typing (or deleting) one
+// record absorbs
+#define NEXTE_UNDO_CHUNK (64 * 1024)
+#define NEXTE_UNDO_MAX (4 * 1024 * 1024)
+#define NEXTE_UNDO_COALESCE_MAX 256
+
+// Unchanged runs shorter than this are written from memory: below it the
+// extra syscall costs more than the copy it saves
+#define NEXTE_COPY_MIN (64 * 1024)
+
+// Follow mode reads at most this much appended text per idle pass, so a
+// file growing faster than it loads doesn't stall the input loop
+#define NEXTE_FOLLOW_MAX (16 * 1024 * 1024)
+
+// Reloading a changed file compares it with the rows this much at a time
+#define NEXTE_RELOAD_BLOCK (64 * 1024)
+
+// Frame output: text shorter than this is copied into the frame buffer
+// rather than given an iovec of its own, which costs about as much
+#define NEXTE_IOV_MIN 32
+
+// Latency histogram layout (HDR-style log-linear buckets): values below
+// LAT_SUB_COUNT ns are exact, above that every power of two is split into
+// LAT_SUB_COUNT / 2 buckets, so any recorded value is within 1/64 (~1.6%)
+#define LAT_SUB_BITS 7
+#define LAT_SUB_COUNT (1 << LAT_SUB_BITS)
+#define LAT_HALF_COUNT (LAT_SUB_COUNT / 2)
+#define LAT_BUCKETS (LAT_SUB_COUNT + (64 - LAT_SUB_BITS) * LAT_HALF_COUNT)
+
+// Screen size used by replay mode when no --size is given
+#define NEXTE_REPLAY_COLS 80
+#define NEXTE_REPLAY_ROWS 24
 
 // Mirrors Ctrl key behavior: clears bits 5-6, mapping 'a'-'z' to 1-26.
 // ASCII designed so Ctrl+letter = letter & 0x1f
@@ -28,6 +112,7 @@
 #define CTRL_KEY(k) ((k) & 0x1f)
 
 enum editorKey {
+  BACKSPACE = 127,   // terminals send DEL (0x7f) for the Backspace key
   ARROW_LEFT = 1000, // starting at 1000 avoids collision with ASCII chars
   ARROW_RIGHT,
   ARROW_UP,
@@ -39,44 +124,711 @@ enum editorKey {
   END_KEY
 };
 
+// Highlight classes, one per byte of erow.render
+enum editorHighlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER
+};
+
+// Lexer state at the end of a row, which is what the next row starts in
+enum editorHlState {
+  HLS_NORMAL = 0,
+  HLS_COMMENT,   // inside a multi-line comment
+  HLS_STRING_DQ, // inside a "string" continued with a trailing backslash
+  HLS_STRING_SQ  // same for a 'string'
+};
+
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
 /*** data ***/
 
-// Editor row type: stores a single line of text
+// Highlighting rules for one file type (see HLDB)
+struct editorSyntax {
+  char *filetype;                // shown in the status bar
+  char **filematch;              // ".ext" suffixes or file name substrings
+  char **keywords;               // a trailing '|' marks a type (HL_KEYWORD2)
+  char *singleline_comment_start;
+  char *multiline_comment_start;
+  char *multiline_comment_end;
+  int flags;                     // HL_HIGHLIGHT_*
+};
+
+// Where a long row's text is at a screen column: chars offset `off` (a
+// character boundary) starts at column `col`
+struct rowCheckpoint {
+  int off;
+  int col;
+};
+
+// How a row shows when its text doesn't show byte for byte: tabs expanded,
+// multi-byte characters with their columns, or a long row's checkpoints
+struct rowRender {
+  int *rcol;    // screen column of each render byte, then the total;
+                // NULL when the row is ASCII and columns are byte offsets
+  struct rowCheckpoint *ckpt; // long rows only (render is then empty)
+  int nckpt;                  // entries in ckpt; the last one is the row's end
+  char render[];              // rendered line with tabs expanded
+};
+
+/*
+ * Editor row type: stores a single line of text. Short rows keep the text
+ * in the row, and an ASCII row without tabs is its own rendering, so such
+ * a line costs no allocation at all. Read the text with editorRowChars()
+ * and the rendering with editorRowRender().
+ */
 typedef struct erow {
   int size;     // length of raw chars
   int rsize;    // length of rendered string
-  char *chars;  // raw line content
-  char *render; // rendered line with tabs expanded
+  union {
+    char *heap;                     // size > NEXTE_ROW_INLINE
+    char inl[NEXTE_ROW_INLINE + 1]; // size <= NEXTE_ROW_INLINE
+  } text;       // raw line content
+  struct rowRender *ext; // NULL when the text renders as it is
+  long long origoff;     // offset of chars + '\n' in E.origfd, -1 if changed
+  _Atomic(unsigned char *) hl; // HL_* per render byte (NULL: not lexed)
+  unsigned int snapgen;  // save snapshot sharing the heap text (0 = none)
+  unsigned char hl_start; // HLS_* state hl was lexed from
+  unsigned char hl_state; // HLS_* the lexer is in at the end of the row
 } erow;
 
+// A row as captured by a save snapshot: shares the text with the live row,
+// or holds a copy when that is inline
+struct saveRow {
+  char *chars;
+  int size;
+  long long origoff; // erow.origoff at snapshot time
+  char inl[NEXTE_ROW_INLINE + 1];
+};
+
+/*
+ * Background save: a consistent snapshot of the row table plus the state
+ * shared with the save thread. Written by the UI thread before the thread
+ * starts; afterwards only `written` and `done` cross threads (atomics).
+ */
+struct saveJob {
+  pthread_t thread;
+  unsigned int gen;      // matches erow.snapgen of rows in the snapshot
+  struct saveRow *rows;  // snapshot of E.row at Ctrl-S time
+  int numrows;
+  char *filename;        // target path
+  char *tmpname;         // mkstemp() file renamed over filename when done
+  int fd;                // open temp file
+  int origfd;            // E.origfd to copy unchanged rows from, or -1
+  mode_t mode;           // permissions for the new file
+  int dirty;             // E.dirty when the snapshot was taken
+  long long total;       // bytes the snapshot will produce
+  atomic_llong written;  // progress, updated by the save thread
+  atomic_int done;       // set by the save thread when it's finished
+  long long result;      // bytes written, or -1 on error (valid once done)
+  long long copied;      // part of result copied kernel-side from origfd
+  int err;               // errno on failure
+  char **retired;        // snapshot text replaced by edits, freed when done
+  int numretired;
+  struct timespec start;
+};
+
 // Editor state: cursor, viewport, dimensions, and original terminal settings
 struct editorConfig {
   int cx, cy;            // cursor position
   int rx;                // rendered cursor position
   int rowoff;            // vertical scroll
   int coloff;            // horizontal scroll
-  int screenrows;        // terminal height
-  int screencols;        // terminal width
+  int screenrows;        // text rows of the focused window
+  int screencols;        // its width
+  int winy, winx;        // where its text starts on the terminal
+  int termrows, termcols; // terminal size
   int numrows;           // number of rows in file
   erow *row;             // holds every row in a file
+  int rowcap;            // rows allocated
   char *filename;        // currently open file (NULL if untitled)
+  struct editorSyntax *syntax; // file type of filename (NULL if none)
+  int dirty;             // nonzero when the buffer has unsaved changes
+  struct saveJob *save;  // running background save (NULL if none)
+  int save_queued;       // Ctrl-S pressed while a save was running
+  int origfd;            // the file as last opened/saved (-1 if none)
+  struct stat origst;    // its fstat() then, to notice outside changes
+  int prompting;         // editorPrompt() owns the message bar
+  int syncoutput;        // terminal supports synchronized output (?2026)
+  int wakepipe[2];       // worker threads poke [1] to wake the input loop
   char statusmsg[80];    // message to display in status bar
-  time_t statusmsg_time; // timestamp when message was set (for expiration)
+  int statusmsglen;
+  long long statusmsg_expiry; // monotonic ms when the message is cleared
   struct termios orig_termios;
 };
 
 struct editorConfig E;
 
+// Headless replay state: decoded keystroke script, per-key timings and the
+// virtual terminal that frames are rendered into instead of stdout
+struct editorReplay {
+  int active;              // nonzero when running from a script, not a tty
+  const char *script;      // script path (for the report header)
+  char *keys;              // decoded script bytes fed to editorReadKey()
+  size_t len;              // number of decoded bytes
+  size_t pos;              // next byte to hand out
+  struct replayTiming *timings;
+  int numtimings;
+  int cols, rows;          // virtual terminal size
+  uint32_t *cells;         // rows * cols code points; 0 = right half of a
+                           // double-width character
+  int vx, vy;              // virtual terminal cursor
+  int top, bottom;         // scroll region, first and last row
+  int wrapnext;            // cursor sits past the last column
+  int esc;                 // escape sequence parser state
+  char csi[32];            // collected CSI parameter/intermediate bytes
+  int csilen;
+  uint32_t cp;             // UTF-8 sequence being decoded
+  int cpneed;              // continuation bytes it still needs
+};
+
+// One timed keypress: key code and ns from read() to end of the next frame
+struct replayTiming {
+  int key;
+  long long ns;
+};
+
+struct editorReplay R;
+
+// Input-to-output latency: from read() returning the first byte of a key in
+// editorReadKey() to write() of the next frame completing
+struct editorLatency {
+  int pending;              // a key was read and its frame not yet written
+  int lastkey;              // key returned by the last editorReadKey()
+  struct timespec keystart; // when the first byte of lastkey was read
+  uint32_t counts[LAT_BUCKETS];
+  uint64_t samples;
+  uint64_t max;             // exact worst case, ns
+  const char *path;         // --latency dump file (NULL: only on SIGUSR1)
+  volatile sig_atomic_t dump_requested; // set by the SIGUSR1 handler
+};
+
+struct editorLatency L;
+
+// Heap held by one kind of per-row allocation
+struct memCount {
+  long long blocks; // allocations
+  long long used;   // bytes the rows need
+  long long alloc;  // bytes the allocator handed out (malloc_usable_size)
+};
+
+// Memory held by the rows of every buffer (Ctrl-U, --stats)
+struct editorMemory {
+  const char *path;       // --stats dump file, written on exit
+  long long rows;
+  int buffers;
+  long long text;         // bytes of text in the rows, inline or not
+  struct memCount chars;  // raw text kept outside the rows
+  struct memCount render; // renderings that aren't the text itself
+  struct memCount cols;   // column maps and long-row checkpoints
+  struct memCount hl;     // highlight classes
+  struct memCount table;  // the E.row arrays
+  long long undo;         // undo log chunks
+};
+
+struct editorMemory M;
+
+// Incremental search (Ctrl-F) state, including a scan split over time slices
+struct editorSearch {
+  char *query;     // current query (owned by editorPrompt())
+  int direction;   // 1 = forward, -1 = backward
+  int match_row;   // row of the match the cursor is on (-1 = none yet)
+  int match_col;
+  int scanning;    // a scan ran out of time and continues when idle
+  int row;         // next row the scan looks at
+  int col;         // only matches right (forward) / left of this count there
+  int remaining;   // rows left before the scan has wrapped all the way round
+  int saved_cx, saved_cy, saved_rowoff, saved_coloff; // restored on ESC
+  int regex;                // query is a regex (Ctrl-R in the prompt)
+  struct rxMatcher *rx;     // compiled query (regexCacheGet()), or NULL
+  char prompt[80];          // prompt format, changes with the mode
+};
+
+struct editorSearch S;
+
+// A match position: row index and byte offset in erow.chars
+struct findMatch {
+  int row;
+  int col;
+};
+
+/*
+ * Find all (Ctrl-G): worker threads claim NEXTE_FINDALL_CHUNK-row slices of
+ * the buffer and publish matches in batches to `queue` (under `lock`); the
+ * UI thread drains the queue into `matches` while they run. Rows aren't
+ * edited while workers run: any keypress stops them first.
+ */
+struct editorFindAll {
+  int running;                 // workers started and not yet joined
+  pthread_t threads[NEXTE_FINDALL_MAX_THREADS];
+  int nthreads;
+  char *query;
+  size_t qlen;
+  int regex;                   // query is a regex (Ctrl-R in the prompt)
+  struct regex *re;            // compiled query; each worker builds its DFA
+  char prompt[80];
+  erow *rows;                  // E.row / E.numrows when the search started
+  int numrows;
+  atomic_int next_chunk;       // first row of the next unclaimed slice
+  atomic_int cancel;           // ask workers to stop
+  atomic_int active;           // workers still scanning
+  pthread_mutex_t lock;        // guards queue and total
+  struct findMatch *queue;     // published but not yet drained
+  int queuelen, queuecap;
+  long long total;             // matches found so far (all workers)
+  struct findMatch *matches;   // drained results (sorted once complete)
+  int nmatches, capmatches;
+  int current;                 // match Ctrl-N/Ctrl-P last jumped to
+  struct timespec start;
+};
+
+struct editorFindAll FA;
+
+/*
+ * Background highlighter: a worker lexes the rows the UI thread left
+ * alone, visible rows first. Rows before `next` are final (lexed from the
+ * end state of a final row); rows after it may be stale or speculative.
+ * Each row's new hl is published with an atomic pointer swap, so drawing
+ * never waits; replaced arrays are freed by the UI thread between frames.
+ * Like find-all, the worker never runs while rows change: edits stop it.
+ * Once the current buffer is done, it goes on with parked buffers shown in
+ * other windows, whose rows don't change until they're current again.
+ */
+struct editorHighlighter {
+  int running;                 // worker started and not yet joined
+  pthread_t thread;
+  int next;                    // first row not known to be final
+  int buf;                     // BL index of the buffer the worker lexes
+  erow *row;                   // its rows, syntax and progress (its next)
+  int numrows;
+  struct editorSyntax *syntax;
+  int at;
+  atomic_int cancel;           // ask the worker to stop
+  atomic_int done;             // worker reached the end of the buffer
+  atomic_int repaint;          // worker changed a visible row
+  atomic_int view_top;         // rows the last frame showed
+  atomic_int view_rows;
+  pthread_mutex_t lock;        // guards retired
+  unsigned char **retired;     // replaced hl arrays, freed by the UI thread
+  int numretired, capretired;
+};
+
+struct editorHighlighter H;
+
+// Undoable edits; each record's inverse is applied on undo
+enum undoType {
+  UNDO_INSERT, // text inserted at row/col
+  UNDO_DELETE, // text deleted at row/col
+  UNDO_SPLIT,  // row split at col (Enter)
+  UNDO_JOIN,   // row + 1 joined onto row, which was col bytes long
+  UNDO_INSROW, // empty row inserted
+  UNDO_DELROW  // row deleted (text is the whole row)
+};
+
+// One log record; its text follows it in the chunk
+struct undoRec {
+  int size;           // bytes to the next record (header + text, aligned)
+  int prev;           // offset of the previous record in the chunk, or -1
+  int step;           // keypress that made it (undo goes one at a time)
+  int row, col;
+  int len;            // text length
+  unsigned char type; // UNDO_*
+  unsigned char span; // the text is a struct undoSpan, not inline bytes
+};
+
+// Text of a deleted row that was still identical to the file on disk
+struct undoSpan {
+  int file;      // index into editorUndo.files
+  long long off; // where the text starts there
+};
+
+// Arena chunk: records packed back to back
+struct undoChunk {
+  struct undoChunk *prev, *next;
+  int cap;  // bytes of data
+  int used;
+  int tail; // offset of the last record, -1 if empty
+  char data[];
+};
+
+// A version of the file kept open because spans point into it
+struct undoFile {
+  int fd;         // -1: no span uses it any more, the slot is free
+  int refs;       // span records in the log that point into it
+  struct stat st; // to notice if anyone rewrote it in place
+};
+
+/*
+ * Undo/redo: an append-only log in arena chunks. Records before the cursor
+ * (cur, off) are undone newest first; those after it are redone. A new
+ * edit drops the redo side; past NEXTE_UNDO_MAX the oldest chunks go.
+ */
+struct editorUndo {
+  struct undoChunk *first, *last; // oldest / newest chunk
+  struct undoChunk *cur;          // cursor chunk (NULL: log empty)
+  int off;                        // cursor offset in cur
+  int step;                       // bumped for every keypress
+  int coalesce;                   // last record may absorb the next edit
+  long long bytes;                // memory held by chunks
+  struct undoFile *files;
+  int nfiles;
+};
+
+struct editorUndo U;
+
+/*
+ * Soft wrap: long rows continue on the next screen lines. Screen lines map
+ * to (file row, segment) through a Fenwick tree over the heights of blocks
+ * of NEXTE_WRAP_BLOCK rows, with a scan of one block for the last step, so
+ * finding the screen line of a row or the row on a screen line costs
+ * O(log n) plus a block. A row changing height updates its block in place;
+ * inserting or deleting a row moves one row across each later block
+ * boundary, which touches two rows per block and rebuilds the small tree.
+ */
+struct editorWrap {
+  int enabled;       // toggled with Ctrl-W
+  int valid;         // sums match E.row (else rebuilt from scratch)
+  int treevalid;     // tree matches sums
+  int cols;          // screen width the heights were computed for
+  long long *sums;   // screen lines per block of rows
+  long long *tree;   // 1-based Fenwick tree over sums
+  int nblocks;
+  int numrows;       // rows indexed
+  long long off;     // first screen line shown
+  int offrow;        // file row of `off` after the last scroll
+  int offseg;        // and the segment of that row it is
+};
+
+struct editorWrap W;
+
+/*
+ * What the terminal shows since the last frame, so the next one sends only
+ * what changed: a hash of the bytes drawn on each text line, and the
+ * viewport top they were drawn for. When the viewport moves by less than a
+ * screen, a scroll region shifts the lines still in view and only the ones
+ * scrolled in are drawn.
+ */
+struct editorScreen {
+  uint64_t *lines; // hash per text line; 0 = unknown, always redrawn
+  int rows, cols;  // screen size the hashes are for
+  long long top;   // viewport top: E.rowoff, or W.off with soft wrap
+  int wrapped;     // W.enabled when they were drawn
+  int status;      // the status bar in B is on screen
+  int message;     // the current status message is on screen
+};
+
+struct editorScreen V;
+
+/*
+ * The status bar as last rendered, with the inputs it was rendered from;
+ * a frame renders it again only when one of them changed.
+ */
+struct editorBars {
+  char *status;         // status bar bytes, SGR sequences included
+  int statuslen;
+  int statuscap;
+  int valid;
+  char name[21];        // inputs: the file name as shown (20 bytes at most)
+  const char *filetype;
+  int numrows, cy, dirty, cols;
+};
+
+struct editorBars B;
+
+/*
+ * The open file as watched for changes made by others: inotify watches on
+ * the file and on its directory. A change reloads just the rows that differ
+ * (editorReload()). In follow mode (tail -f), text appended to the file is
+ * read from where loading stopped and added as rows, and a cursor on the
+ * last row stays there.
+ */
+struct editorWatch {
+  int follow;        // toggled with Ctrl-T, or --follow
+  int fd;            // inotify instance (-1 until first needed)
+  int wd, dirwd;     // watches on the file and its directory (-1 = none)
+  int changed;       // the file was written to since the last read
+  int moved;         // the path may name a different file now
+  int warned;        // told the user that edits hold reloading back
+  long long off;     // the file's complete lines end here
+  long long end;     // everything up to here is loaded; past `off` it's
+                     // an unterminated last line, the last row
+  char tail[16];     // the bytes just before `end`, to notice rewrites
+  int taillen;
+};
+
+struct editorWatch T;
+
+/*
+ * An open file that isn't current: the per-file parts of E, H, U, W and T,
+ * parked while another buffer is shown. The current buffer's state is in
+ * those globals themselves, so the rest of the editor only ever sees one
+ * buffer, and switching copies this struct each way: rows keep their
+ * renders and highlighting. The terminal, the screen cache, the worker
+ * threads and the inotify instance are shared by all buffers, so an extra
+ * buffer costs this struct plus its rows.
+ */
+struct editorBuffer {
+  int cx, cy, rx, rowoff, coloff;
+  int numrows;
+  erow *row;
+  int rowcap;
+  char *filename;
+  struct editorSyntax *syntax;
+  int dirty;
+  int origfd;
+  struct stat origst;
+  int hlnext;              // H.next
+  struct editorUndo undo;
+  struct editorWrap wrap;
+  struct editorWatch watch; // all but the shared inotify fd
+};
+
+// Open buffers, in Ctrl-B order
+struct editorBuffers {
+  struct editorBuffer *bufs; // bufs[cur] is stale: its state is in globals
+  int num, cap;
+  int cur;
+};
+
+struct editorBuffers BL;
+
+// How a node of the window layout divides its area
+enum editorSplit {
+  SPLIT_NONE = 0, // not divided: a window
+  SPLIT_ROWS,     // one child above the other
+  SPLIT_COLS      // side by side, with a divider column between
+};
+
+/*
+ * A node of the window layout: a split of an area in two, or a window (a
+ * leaf) showing a buffer. Like the current buffer's, the focused window's
+ * state is in the globals (E's viewport and size, W's scroll position, V
+ * and B); any other window is drawn by swapping its state in for a moment.
+ * Windows on one buffer draw from the same rows, so text is rendered and
+ * highlighted once however many windows show it.
+ */
+struct editorWindow {
+  int used;
+  int split;              // SPLIT_*
+  int parent;             // split holding this node, -1 for the root
+  int child[2];           // split: top/left and bottom/right nodes
+  int y, x, rows, cols;   // area on the terminal, status line included
+  int buf;                // BL index of the buffer shown
+  int cx, cy, rx, rowoff, coloff;
+  long long wrapoff;      // W.off, W.offrow and W.offseg
+  int wrapoffrow, wrapoffseg;
+  struct editorScreen screen; // V
+  struct editorBars bar;      // B
+};
+
+struct editorWindows {
+  struct editorWindow *nodes; // nodes[cur] is stale: its state is in globals
+  int num, cap;
+  int root;
+  int cur;                    // the focused window
+  int borders;                // dividers are on screen
+};
+
+struct editorWindows WN;
+
+// Inclusive range of code points sharing a display width
+struct widthRange {
+  uint32_t first, last;
+};
+
+/*** filetypes ***/
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", ".cc", NULL};
+char *C_HL_keywords[] = {
+    "switch",  "if",      "while",  "for",     "break",   "continue",
+    "return",  "else",    "struct", "union",   "typedef", "static",
+    "enum",    "class",   "case",   "default", "do",      "goto",
+    "sizeof",  "const",   "extern", "#include", "#define", "#ifdef",
+    "#ifndef", "#endif",  "#else",  "#if",
+
+    "int|",    "long|",   "double|", "float|", "char|",   "unsigned|",
+    "signed|", "void|",   "short|", "size_t|", "ssize_t|", NULL};
+
+// Highlight database: the first entry whose filematch fits the file wins
+struct editorSyntax HLDB[] = {
+    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+/*** character widths ***/
+
+// Combining marks and format characters: drawn over the previous cell
+const struct widthRange zeroWidth[] = {
+    {0x0300, 0x036F},   {0x0483, 0x0489},   {0x0591, 0x05BD},
+    {0x05BF, 0x05BF},   {0x05C1, 0x05C2},   {0x05C4, 0x05C5},
+    {0x05C7, 0x05C7},   {0x0610, 0x061A},   {0x064B, 0x065F},
+    {0x0670, 0x0670},   {0x06D6, 0x06DC},   {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8},   {0x06EA, 0x06ED},   {0x0711, 0x0711},
+    {0x0730, 0x074A},   {0x07A6, 0x07B0},   {0x07EB, 0x07F3},
+    {0x0816, 0x0819},   {0x081B, 0x0823},   {0x0825, 0x0827},
+    {0x0829, 0x082D},   {0x0859, 0x085B},   {0x08D3, 0x08E1},
+    {0x08E3, 0x0902},   {0x093A, 0x093A},   {0x093C, 0x093C},
+    {0x0941, 0x0948},   {0x094D, 0x094D},   {0x0951, 0x0957},
+    {0x0962, 0x0963},   {0x0981, 0x0981},   {0x09BC, 0x09BC},
+    {0x09C1, 0x09C4},   {0x09CD, 0x09CD},   {0x09E2, 0x09E3},
+    {0x0A01, 0x0A02},   {0x0A3C, 0x0A3C},   {0x0A41, 0x0A42},
+    {0x0A47, 0x0A48},   {0x0A4B, 0x0A4D},   {0x0A70, 0x0A71},
+    {0x0A81, 0x0A82},   {0x0ABC, 0x0ABC},   {0x0AC1, 0x0AC5},
+    {0x0AC7, 0x0AC8},   {0x0ACD, 0x0ACD},   {0x0B01, 0x0B01},
+    {0x0B3C, 0x0B3C},   {0x0B3F, 0x0B3F},   {0x0B41, 0x0B44},
+    {0x0B4D, 0x0B4D},   {0x0B82, 0x0B82},   {0x0BC0, 0x0BC0},
+    {0x0BCD, 0x0BCD},   {0x0C3E, 0x0C40},   {0x0C46, 0x0C48},
+    {0x0C4A, 0x0C4D},   {0x0CBC, 0x0CBC},   {0x0CCC, 0x0CCD},
+    {0x0D41, 0x0D44},   {0x0D4D, 0x0D4D},   {0x0DCA, 0x0DCA},
+    {0x0DD2, 0x0DD4},   {0x0DD6, 0x0DD6},   {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A},   {0x0E47, 0x0E4E},   {0x0EB1, 0x0EB1},
+    {0x0EB4, 0x0EBC},   {0x0EC8, 0x0ECD},   {0x0F18, 0x0F19},
+    {0x0F35, 0x0F35},   {0x0F37, 0x0F37},   {0x0F39, 0x0F39},
+    {0x0F71, 0x0F7E},   {0x0F80, 0x0F84},   {0x0F86, 0x0F87},
+    {0x0F8D, 0x0FBC},   {0x0FC6, 0x0FC6},   {0x102D, 0x1030},
+    {0x1032, 0x1037},   {0x1039, 0x103A},   {0x1058, 0x1059},
+    {0x1160, 0x11FF},   {0x135D, 0x135F},   {0x1712, 0x1714},
+    {0x1732, 0x1734},   {0x1752, 0x1753},   {0x1772, 0x1773},
+    {0x17B4, 0x17B5},   {0x17B7, 0x17BD},   {0x17C6, 0x17C6},
+    {0x17C9, 0x17D3},   {0x17DD, 0x17DD},   {0x180B, 0x180F},
+    {0x18A9, 0x18A9},   {0x1920, 0x1922},   {0x1927, 0x1928},
+    {0x1932, 0x1932},   {0x1939, 0x193B},   {0x1A17, 0x1A18},
+    {0x1AB0, 0x1AFF},   {0x1B00, 0x1B03},   {0x1B34, 0x1B34},
+    {0x1B36, 0x1B3A},   {0x1B6B, 0x1B73},   {0x1DC0, 0x1DFF},
+    {0x200B, 0x200F},   {0x202A, 0x202E},   {0x2060, 0x2064},
+    {0x20D0, 0x20F0},   {0x2CEF, 0x2CF1},   {0x2DE0, 0x2DFF},
+    {0x302A, 0x302D},   {0x3099, 0x309A},   {0xA66F, 0xA672},
+    {0xA674, 0xA67D},   {0xA69E, 0xA69F},   {0xA6F0, 0xA6F1},
+    {0xA802, 0xA802},   {0xA806, 0xA806},   {0xA80B, 0xA80B},
+    {0xA825, 0xA826},   {0xA8C4, 0xA8C5},   {0xA8E0, 0xA8F1},
+    {0xA926, 0xA92D},   {0xA947, 0xA951},   {0xA980, 0xA982},
+    {0xA9B3, 0xA9B3},   {0xA9B6, 0xA9B9},   {0xA9BC, 0xA9BC},
+    {0xAA29, 0xAA2E},   {0xAA31, 0xAA32},   {0xAA35, 0xAA36},
+    {0xAA43, 0xAA43},   {0xAA4C, 0xAA4C},   {0xAAB0, 0xAAB0},
+    {0xAAB2, 0xAAB4},   {0xAAB7, 0xAAB8},   {0xAABE, 0xAABF},
+    {0xAAC1, 0xAAC1},   {0xABE5, 0xABE5},   {0xABE8, 0xABE8},
+    {0xABED, 0xABED},   {0xFB1E, 0xFB1E},   {0xFE00, 0xFE0F},
+    {0xFE20, 0xFE2F},   {0xFEFF, 0xFEFF},   {0xFFF9, 0xFFFB},
+    {0x101FD, 0x101FD}, {0x10A01, 0x10A03}, {0x10A05, 0x10A06},
+    {0x10A0C, 0x10A0F}, {0x10A38, 0x10A3A}, {0x10A3F, 0x10A3F},
+    {0x11001, 0x11001}, {0x11038, 0x11046}, {0x1107F, 0x11081},
+    {0x110B3, 0x110B6}, {0x110B9, 0x110BA}, {0x1D167, 0x1D169},
+    {0x1D173, 0x1D182}, {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD},
+    {0x1D242, 0x1D244}, {0xE0001, 0xE0001}, {0xE0020, 0xE007F},
+    {0xE0100, 0xE01EF},
+};
+
+// East Asian Wide and Fullwidth characters, emoji presentation included
+const struct widthRange doubleWidth[] = {
+    {0x1100, 0x115F},   {0x231A, 0x231B},   {0x2329, 0x232A},
+    {0x23E9, 0x23EC},   {0x23F0, 0x23F0},   {0x23F3, 0x23F3},
+    {0x25FD, 0x25FE},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267F, 0x267F},   {0x2693, 0x2693},   {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB},   {0x26BD, 0x26BE},   {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE},   {0x26D4, 0x26D4},   {0x26EA, 0x26EA},
+    {0x26F2, 0x26F3},   {0x26F5, 0x26F5},   {0x26FA, 0x26FA},
+    {0x26FD, 0x26FD},   {0x2705, 0x2705},   {0x270A, 0x270B},
+    {0x2728, 0x2728},   {0x274C, 0x274C},   {0x274E, 0x274E},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27B0, 0x27B0},   {0x27BF, 0x27BF},   {0x2B1B, 0x2B1C},
+    {0x2B50, 0x2B50},   {0x2B55, 0x2B55},   {0x2E80, 0x303E},
+    {0x3041, 0x3247},   {0x3250, 0x4DBF},   {0x4E00, 0xA4CF},
+    {0xA960, 0xA97F},   {0xAC00, 0xD7A3},   {0xF900, 0xFAFF},
+    {0xFE10, 0xFE19},   {0xFE30, 0xFE6F},   {0xFF00, 0xFF60},
+    {0xFFE0, 0xFFE6},   {0x16FE0, 0x16FE4}, {0x17000, 0x18CFF},
+    {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+    {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F202},
+    {0x1F210, 0x1F23B}, {0x1F240, 0x1F248}, {0x1F250, 0x1F251},
+    {0x1F260, 0x1F265}, {0x1F300, 0x1F320}, {0x1F32D, 0x1F335},
+    {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA},
+    {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4},
+    {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC},
+    {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567},
+    {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4},
+    {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC},
+    {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6D7}, {0x1F6EB, 0x1F6EC},
+    {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F93A},
+    {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+    {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+#define WIDTH_ENTRIES(t) ((int)(sizeof(t) / sizeof(t[0])))
+
+/*** prototypes ***/
+
+void editorReplayFinish(void);
+void editorReplayFeed(const char *s, int len);
+void editorReplayFrameDone(long long ns);
+void editorLatencyDump(void);
+void editorSave();
+void editorRowReleaseChars(erow *row);
+void editorRowUnshare(erow *row);
+int editorSavePoll();
+int writevAll(int fd, struct iovec *iov, int cnt);
+void editorSetStatusMessage(const char *fmt, ...);
+void editorRefreshScreen();
+char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorFindStep();
+const char *findSubstring(const char *hay, size_t n, const char *needle,
+                          size_t m);
+int editorFindAllPoll();
+int editorHighlightPoll();
+int editorOrigValid();
+void editorFindAllStop(int cancel);
+int editorWatchPoll();
+int editorWatchFile();
+void editorWatchRebase(long long off, long long end);
+void editorWatchSaved();
+void editorScreenInvalidate(void);
+void editorWindowsBufferClosed(int closed);
+int editorWindowFirst(int n);
+int editorWindowNext(int n);
+char *editorRowChars(const erow *row);
+char *editorRowRender(const erow *row);
+int *editorRowRcol(const erow *row);
+struct rowCheckpoint *editorRowCkpt(const erow *row);
+
 /*** terminal ***/
 
+/*
+ * Send bytes to the terminal.
+ * In replay mode the bytes go to the virtual terminal instead, so a script
+ * run leaves stdout free for the timing report.
+ */
+void editorWriteOutput(const char *s, int len) {
+  if (R.active) {
+    editorReplayFeed(s, len);
+    return;
+  }
+  write(STDOUT_FILENO, s, len);
+}
+
+// editorWriteOutput() for a frame gathered from several buffers
+void editorWriteOutputv(struct iovec *iov, int cnt) {
+  if (R.active) {
+    for (int i = 0; i < cnt; i++) {
+      editorReplayFeed(iov[i].iov_base, iov[i].iov_len);
+    }
+    return;
+  }
+  writevAll(STDOUT_FILENO, iov, cnt);
+}
+
 /*
  * Print error message with errno context and exit.
  * perror() appends ": <system error string>" to the message.
  */
 void die(const char *s) {
   // Clear screen before printing error for readability
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  editorWriteOutput("\x1b[2J", 4);
+  editorWriteOutput("\x1b[H", 3);
 
   perror(s);
   exit(1);
@@ -138,81 +890,255 @@ void enable_raw_mode(void) {
 }
 
 /*
- * Read a single keypress from stdin.
- * Returns ASCII character or enum value for special keys.
- * Parses ANSI escape sequences: ESC [ N ~ for special keys, ESC [ A/D/B/C for
- * arrows.
+ * Read one byte of input: from stdin, or from the decoded script in replay
+ * mode. Mirrors read(): 1 on success, 0 on timeout, -1 on error.
  */
-int editorReadKey() {
-  int nread;
-  char c;
+int editorReadByte(char *c) {
+  if (R.active) {
+    if (R.pos >= R.len) {
+      return 0;
+    }
+    *c = R.keys[R.pos++];
+    return 1;
+  }
+  return read(STDIN_FILENO, c, 1);
+}
 
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
-      die("read");
+// CLOCK_MONOTONIC in milliseconds
+long long editorNowMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/*
+ * Wait up to `timeout` ms for a key on stdin.
+ * Background threads end the wait early by writing to E.wakepipe (see
+ * editorWake()); those bytes are drained here. Returns 1 if a key is ready.
+ * Watch events are left for editorWatchPoll().
+ */
+int editorWaitForInput(int timeout) {
+  // A followed file's watch events wake the loop too (poll() skips fd -1)
+  struct pollfd pfd[3] = {
+      {STDIN_FILENO, POLLIN, 0},
+      {E.wakepipe[0], POLLIN, 0},
+      {T.fd, POLLIN, 0},
+  };
+
+  if (poll(pfd, 3, timeout) <= 0) {
+    return 0;
+  }
+  if (pfd[1].revents & POLLIN) {
+    char buf[64];
+    while (read(E.wakepipe[0], buf, sizeof(buf)) > 0)
+      ;
   }
+  return (pfd[0].revents & POLLIN) != 0;
+}
 
-  if (c == '\x1b') {
-    char seq[3];
-
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) {
-      return '\x1b';
-    }
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) {
-      return '\x1b';
-    }
-
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1)
-          return '\x1b';
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1':
-              return HOME_KEY;
-            case '3':
-              return DEL_KEY;
-            case '4':
-              return END_KEY;
-            case '5':
-              return PAGE_UP;
-            case '6':
-              return PAGE_DOWN;
-            case '7':
-              return HOME_KEY;
-            case '8':
-              return END_KEY;
-          }
-        }
-      } else {
+/*
+ * Wake the input loop from another thread so editorIdle() runs now.
+ * The pipe is non-blocking: if it's full a wakeup is already pending.
+ */
+void editorWake() {
+  char c = 0;
+  if (write(E.wakepipe[1], &c, 1) == -1) {
+    // EAGAIN: plenty of wakeups queued already
+  }
+}
+
+/*
+ * Is there time-sliced work that wants to run as soon as input is idle?
+ * While this holds, editorReadKey() calls editorIdle() instead of blocking.
+ */
+int editorIdlePending() { return S.scanning; }
+
+/*
+ * How long the input loop may block before editorIdle() is due: until the
+ * status message expires, and at most 100 ms.
+ */
+int editorIdleTimeout() {
+  if (editorIdlePending()) {
+    return 0;
+  }
+  if (E.statusmsglen && !E.prompting) {
+    long long left = E.statusmsg_expiry - editorNowMs();
+    if (left < 100) {
+      return left > 0 ? (int)left : 0;
+    }
+  }
+  return 100;
+}
+
+// Clear the status message once it has expired; returns 1 if it did
+int editorStatusMessagePoll() {
+  // An open prompt is in the message bar until it closes
+  if (!E.statusmsglen || E.prompting ||
+      editorNowMs() < E.statusmsg_expiry) {
+    return 0;
+  }
+  E.statusmsg[0] = '\0';
+  E.statusmsglen = 0;
+  V.message = 0;
+  return 1;
+}
+
+/*
+ * Housekeeping while waiting for input (every poll() timeout, signal or
+ * wakeup): pending latency dumps, background save progress, the next slice
+ * of a running search, results streamed in by find-all workers, rows
+ * lexed by the background highlighter, an expired status message and
+ * changes made to the file by others.
+ */
+void editorIdle() {
+  int redraw = 0;
+
+  if (L.dump_requested) {
+    editorLatencyDump();
+  }
+  if (editorSavePoll()) {
+    redraw = 1;
+  }
+  if (S.scanning) {
+    editorFindStep();
+    redraw = 1;
+  }
+  if (editorFindAllPoll()) {
+    redraw = 1;
+  }
+  if (editorHighlightPoll()) {
+    redraw = 1;
+  }
+  if (editorStatusMessagePoll()) {
+    redraw = 1;
+  }
+  if (editorWatchPoll()) {
+    redraw = 1;
+  }
+  if (redraw) {
+    editorRefreshScreen();
+  }
+}
+
+/*
+ * Decode the rest of an escape sequence after its leading ESC byte.
+ * Returns the matching editorKey, or a bare ESC if the sequence is unknown
+ * or the follow-up bytes don't arrive in time. A script has no timeout to
+ * tell a lone ESC from a sequence, so in replay only an ESC followed by [
+ * or O starts one.
+ */
+int editorReadEscape() {
+  char seq[3];
+
+  if (R.active &&
+      (R.pos >= R.len || (R.keys[R.pos] != '[' && R.keys[R.pos] != 'O'))) {
+    return '\x1b';
+  }
+  if (editorReadByte(&seq[0]) != 1) {
+    return '\x1b';
+  }
+  if (editorReadByte(&seq[1]) != 1) {
+    return '\x1b';
+  }
+
+  if (seq[0] == '[') {
+    if (seq[1] >= '0' && seq[1] <= '9') {
+      if (editorReadByte(&seq[2]) != 1)
+        return '\x1b';
+      if (seq[2] == '~') {
         switch (seq[1]) {
-          case 'A':
-            return ARROW_UP;
-          case 'B':
-            return ARROW_DOWN;
-          case 'C':
-            return ARROW_RIGHT;
-          case 'D':
-            return ARROW_LEFT;
-          case 'H':
+          case '1':
+            return HOME_KEY;
+          case '3':
+            return DEL_KEY;
+          case '4':
+            return END_KEY;
+          case '5':
+            return PAGE_UP;
+          case '6':
+            return PAGE_DOWN;
+          case '7':
             return HOME_KEY;
-          case 'F':
+          case '8':
             return END_KEY;
         }
       }
-    } else if (seq[0] == 'O') {
+    } else {
       switch (seq[1]) {
+        case 'A':
+          return ARROW_UP;
+        case 'B':
+          return ARROW_DOWN;
+        case 'C':
+          return ARROW_RIGHT;
+        case 'D':
+          return ARROW_LEFT;
         case 'H':
           return HOME_KEY;
         case 'F':
           return END_KEY;
       }
     }
+  } else if (seq[0] == 'O') {
+    switch (seq[1]) {
+      case 'H':
+        return HOME_KEY;
+      case 'F':
+        return END_KEY;
+    }
+  }
 
-    return '\x1b';
-  } else {
-    return c;
+  return '\x1b';
+}
+
+/*
+ * Read a single keypress from stdin.
+ * Returns ASCII character or enum value for special keys.
+ * Parses ANSI escape sequences: ESC [ N ~ for special keys, ESC [ A/D/B/C for
+ * arrows.
+ * In replay mode an exhausted script ends the run here, wherever the editor
+ * happens to be waiting for its next key; otherwise the key is timestamped so
+ * the next frame can be charged to it (see editorLatencyFrameDone()).
+ */
+int editorReadKey() {
+  int nread;
+  char c;
+
+  while (1) {
+    // Idle work runs between keys, never while a key is waiting. Pending
+    // time-sliced work doesn't block at all; otherwise wake up every 100 ms
+    // or when the status message expires, whichever comes first
+    if (!R.active && !editorWaitForInput(editorIdleTimeout())) {
+      editorIdle();
+      continue;
+    }
+    // Replay runs find-all to completion before the next key stops it
+    if (R.active && FA.running) {
+      editorFindAllStop(0);
+      editorRefreshScreen();
+    }
+    if ((nread = editorReadByte(&c)) == 1) {
+      break;
+    }
+    // EINTR: a signal such as SIGUSR1 interrupted the wait
+    if (nread == -1 && errno != EAGAIN && errno != EINTR)
+      die("read");
+    if (R.active) {
+      editorReplayFinish();
+    }
+    editorIdle();
   }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int key = (c == '\x1b') ? editorReadEscape() : (unsigned char)c;
+
+  L.keystart = start;
+  L.lastkey = key;
+  L.pending = 1;
+
+  return key;
 }
 
 /*
@@ -256,6 +1182,42 @@ int getCursorPosition(int *rows, int *cols) {
   return 0;
 }
 
+/*
+ * Ask the terminal once, at startup, whether it supports synchronized
+ * output (DEC private mode 2026). DECRQM asks for the mode's state, and a
+ * DA1 request behind it serves as a sentinel, since every terminal answers
+ * that: a DA1 reply with no DECRPM before it means the mode is unknown.
+ * States 1-3 (set, reset, permanently set) mean it is supported.
+ */
+int editorDetectSyncOutput(void) {
+  if (write(STDOUT_FILENO, "\x1b[?2026$p\x1b[c", 13) != 13) {
+    return 0;
+  }
+
+  char buf[128];
+  int len = 0, seq = -1;
+  while (len < (int)sizeof(buf) - 1) {
+    // Nothing for 100 ms (VTIME): the terminal isn't answering
+    if (read(STDIN_FILENO, &buf[len], 1) != 1) {
+      break;
+    }
+    char c = buf[len++];
+    if (c == '\x1b') {
+      seq = len - 1;
+    } else if (c == 'c' && seq >= 0 && len - seq > 3 && buf[seq + 2] == '?') {
+      break; // the DA1 reply, which comes last
+    }
+  }
+  buf[len] = '\0';
+
+  int state;
+  char *reply = strstr(buf, "\x1b[?2026;");
+  if (reply == NULL || sscanf(reply + 8, "%d$y", &state) != 1) {
+    return 0;
+  }
+  return state >= 1 && state <= 3;
+}
+
 /*
  * Get terminal window size via ioctl(TIOCGWINSZ).
  * Returns 0 on success, -1 on failure (fallback to default).
@@ -278,345 +1240,6572 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
-/*** row operations ***/
+/*** syntax highlighting ***/
+
+int isSeparator(int c) {
+  return isspace((unsigned char)c) || c == '\0' ||
+         strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
 
 /*
- * Convert logical cursor column to rendered column.
- * Tabs take multiple screen columns but count as one character.
+ * Lex one row's render text into `hl` (rsize bytes) by the rules of `syn`,
+ * starting in lexer state `state` (the previous row's end state). Returns
+ * the state the row ends in. Only reads the row, so the background worker
+ * can use it too.
  */
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t') {
-      // Tab stops align to every NEXTE_TAB_STOP columns
-      // Calculate spaces needed to reach next tab stop
-      rx += (NEXTE_TAB_STOP - 1) - (rx % NEXTE_TAB_STOP);
+int editorLexRow(const struct editorSyntax *syn, const erow *row, int state,
+                 unsigned char *hl) {
+  memset(hl, HL_NORMAL, row->rsize);
+  // Long rows aren't rendered, so they aren't lexed either: assume whatever
+  // they open they also close
+  if (editorRowCkpt(row)) {
+    return HLS_NORMAL;
+  }
+  const char *render = editorRowRender(row);
+
+  char **keywords = syn->keywords;
+  char *scs = syn->singleline_comment_start;
+  char *mcs = syn->multiline_comment_start;
+  char *mce = syn->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  int prev_sep = 1;
+  int in_comment = (state == HLS_COMMENT);
+  int in_string = state == HLS_STRING_DQ   ? '"'
+                  : state == HLS_STRING_SQ ? '\''
+                                           : 0;
+  int continued = 0; // string runs into a backslash at the end of the row
+
+  int i = 0;
+  while (i < row->rsize) {
+    char c = render[i];
+    unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+
+    if (scs_len && !in_string && !in_comment &&
+        !strncmp(&render[i], scs, scs_len)) {
+      memset(&hl[i], HL_COMMENT, row->rsize - i);
+      break;
     }
 
-    rx++;
+    if (mcs_len && mce_len && !in_string) {
+      if (in_comment) {
+        hl[i] = HL_MLCOMMENT;
+        if (!strncmp(&render[i], mce, mce_len)) {
+          memset(&hl[i], HL_MLCOMMENT, mce_len);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+        } else {
+          i++;
+        }
+        continue;
+      } else if (!strncmp(&render[i], mcs, mcs_len)) {
+        memset(&hl[i], HL_MLCOMMENT, mcs_len);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+
+    if (syn->flags & HL_HIGHLIGHT_STRINGS) {
+      if (in_string) {
+        hl[i] = HL_STRING;
+        if (c == '\\') {
+          // An escape; a backslash ending the row continues the string
+          if (i + 1 == row->rsize) {
+            continued = 1;
+          } else {
+            hl[i + 1] = HL_STRING;
+          }
+          i += 2;
+          continue;
+        }
+        if (c == in_string) {
+          in_string = 0;
+        }
+        i++;
+        prev_sep = 1;
+        continue;
+      } else if (c == '"' || c == '\'') {
+        in_string = c;
+        hl[i] = HL_STRING;
+        i++;
+        continue;
+      }
+    }
+
+    if (syn->flags & HL_HIGHLIGHT_NUMBERS) {
+      if ((isdigit((unsigned char)c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+          (c == '.' && prev_hl == HL_NUMBER)) {
+        hl[i] = HL_NUMBER;
+        i++;
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    if (prev_sep) {
+      int j;
+      for (j = 0; keywords[j]; j++) {
+        int klen = strlen(keywords[j]);
+        int kw2 = keywords[j][klen - 1] == '|';
+        if (kw2) {
+          klen--;
+        }
+
+        if (!strncmp(&render[i], keywords[j], klen) &&
+            isSeparator(render[i + klen])) {
+          memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+          i += klen;
+          break;
+        }
+      }
+      if (keywords[j] != NULL) {
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    prev_sep = isSeparator(c);
+    i++;
   }
-  return rx;
+
+  if (in_comment) {
+    return HLS_COMMENT;
+  } else if (in_string && continued) {
+    return in_string == '"' ? HLS_STRING_DQ : HLS_STRING_SQ;
+  }
+  return HLS_NORMAL;
 }
 
 /*
- * Process tabs in a row: expand them to spaces for display.
- * Allocates render buffer large enough to hold expanded tabs.
+ * Lex a row in place (UI thread, highlighter stopped).
  */
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  for (int i = 0; i < row->size; i++) {
-    if (row->chars[i] == '\t') {
-      tabs++;
+void editorHighlightRow(erow *row, int state) {
+  unsigned char *hl = realloc(row->hl, row->rsize + 1);
+  row->hl_start = state;
+  row->hl_state = editorLexRow(E.syntax, row, state, hl);
+  row->hl = hl;
+}
+
+/*
+ * Rehighlight row `at` after an edit, then the rows below only while the
+ * state they were lexed from has changed: an edit inside a function costs
+ * one row. A change that runs on (opening a comment) is followed to the
+ * bottom of the screen here; the background worker takes over after that.
+ */
+void editorUpdateSyntax(int at) {
+  if (E.syntax == NULL || at >= E.numrows) {
+    return;
+  }
+  editorHighlightRow(&E.row[at],
+                     at > 0 ? E.row[at - 1].hl_state : HLS_NORMAL);
+  // Past `next` the start state was a guess: the worker rechecks the row
+  if (at >= H.next) {
+    if (at == H.next) {
+      H.next++;
     }
+    return;
   }
 
-  free(row->render);
-  // Each tab can expand to up to (NEXTE_TAB_STOP - 1) extra spaces
-  row->render = malloc(row->size + tabs * (NEXTE_TAB_STOP - 1) + 1);
+  int limit = E.rowoff + E.screenrows;
+  for (int i = at + 1; i < E.numrows; i++) {
+    erow *row = &E.row[i];
+    int state = E.row[i - 1].hl_state;
 
-  int idx = 0;
-  for (int i = 0; i < row->size; i++) {
-    if (row->chars[i] == '\t') {
-      // Convert tab to spaces up to next tab stop
-      row->render[idx++] = ' ';
-      while (idx % NEXTE_TAB_STOP != 0) {
-        row->render[idx++] = ' ';
+    if (row->hl && row->hl_start == state) {
+      return;
+    }
+    if (i >= H.next) {
+      return;
+    }
+    if (i >= limit) {
+      H.next = i;
+      return;
+    }
+    editorHighlightRow(row, state);
+  }
+}
+
+/*
+ * Worker side: lex row `i` from `state` into a fresh array and publish it.
+ */
+void highlightPublish(int i, int state) {
+  erow *row = &H.row[i];
+  unsigned char *hl = malloc(row->rsize + 1);
+
+  row->hl_start = state;
+  row->hl_state = editorLexRow(H.syntax, row, state, hl);
+  unsigned char *old = atomic_exchange(&row->hl, hl);
+
+  // The UI may be drawing from the old array: it frees it between frames
+  if (old) {
+    pthread_mutex_lock(&H.lock);
+    if (H.numretired == H.capretired) {
+      H.capretired = H.capretired ? H.capretired * 2 : 64;
+      H.retired = realloc(H.retired, sizeof(*H.retired) * H.capretired);
+    }
+    H.retired[H.numretired++] = old;
+    pthread_mutex_unlock(&H.lock);
+  }
+
+  int top = atomic_load_explicit(&H.view_top, memory_order_relaxed);
+  int rows = atomic_load_explicit(&H.view_rows, memory_order_relaxed);
+  if (i >= top && i < top + rows) {
+    atomic_store(&H.repaint, 1);
+  }
+}
+
+/*
+ * Worker: before every batch of the in-order pass, lex the visible rows
+ * that aren't final yet, guessing their start state from the row above
+ * (normal if that isn't lexed either). The in-order pass redoes a guess
+ * only if it turns out wrong, so it costs nothing when right.
+ */
+void *highlightWorker(void *arg) {
+  int i = H.at;
+  (void)arg;
+
+  while (i < H.numrows && !atomic_load(&H.cancel)) {
+    int top = atomic_load(&H.view_top);
+    int bottom = top + atomic_load(&H.view_rows);
+    if (bottom > H.numrows) {
+      bottom = H.numrows;
+    }
+    for (int v = top > i ? top : i; v < bottom; v++) {
+      erow *prev = v > 0 ? &H.row[v - 1] : NULL;
+      int state = prev && prev->hl ? prev->hl_state : HLS_NORMAL;
+      if (H.row[v].hl == NULL || H.row[v].hl_start != state) {
+        highlightPublish(v, state);
+      }
+    }
+
+    int end = i + NEXTE_HL_BATCH;
+    for (; i < H.numrows && i < end; i++) {
+      int state = i > 0 ? H.row[i - 1].hl_state : HLS_NORMAL;
+      if (H.row[i].hl == NULL || H.row[i].hl_start != state) {
+        highlightPublish(i, state);
       }
-    } else {
-      row->render[idx++] = row->chars[i];
     }
+    H.at = i;
+
+    if (atomic_exchange(&H.repaint, 0) && !R.active) {
+      atomic_store(&H.repaint, 1);
+      editorWake();
+    }
+  }
+
+  atomic_store(&H.done, 1);
+  if (!R.active) {
+    editorWake();
   }
+  return NULL;
+}
+
+// Free the hl arrays the worker replaced (UI thread, not while drawing)
+void editorHighlightReap() {
+  pthread_mutex_lock(&H.lock);
+  for (int i = 0; i < H.numretired; i++) {
+    free(H.retired[i]);
+  }
+  H.numretired = 0;
+  pthread_mutex_unlock(&H.lock);
+}
 
-  row->render[idx] = '\0';
-  row->rsize = idx;
+// Keep how far the worker got with the buffer it lexed (UI thread)
+void highlightRecord() {
+  if (H.buf == BL.cur) {
+    H.next = H.at;
+  } else {
+    BL.bufs[H.buf].hlnext = H.at;
+  }
 }
 
 /*
- * Append a new row to the editor's row buffer.
- * Reallocates the row array to fit one more erow struct.
+ * Stop the worker before rows change (UI thread). Whatever buffer it was
+ * lexing, it carries on from where it stopped next time it starts.
  */
-void editorAppendRow(char *s, size_t len) {
-  // Grow array to hold new row (realloc handles NULL for first allocation)
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+void editorHighlightStop() {
+  if (!H.running) {
+    return;
+  }
+  atomic_store(&H.cancel, 1);
+  pthread_join(H.thread, NULL);
+  H.running = 0;
+  highlightRecord();
+  editorHighlightReap();
+}
 
-  int at = E.numrows;
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+/*
+ * Point the worker at the first parked buffer, in layout order, that a
+ * window shows and that has rows left to lex, with that window's rows as
+ * the visible ones. Returns 0 if there is none.
+ */
+int highlightParked() {
+  int first = editorWindowFirst(WN.root);
+  int n = first;
+  do {
+    struct editorWindow *w = &WN.nodes[n];
+    struct editorBuffer *b = w->buf == BL.cur ? NULL : &BL.bufs[w->buf];
+    if (n != WN.cur && b && b->syntax && b->hlnext < b->numrows) {
+      H.buf = w->buf;
+      H.row = b->row;
+      H.numrows = b->numrows;
+      H.syntax = b->syntax;
+      H.at = b->hlnext;
+      atomic_store(&H.view_top, w->rowoff);
+      atomic_store(&H.view_rows, w->rows - 1);
+      return 1;
+    }
+    n = editorWindowNext(n);
+  } while (n != first);
+  return 0;
+}
 
-  // Initialize render fields and compute rendered tab expansion
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  editorUpdateRow(&E.row[at]);
+/*
+ * Start the worker if rows are left to lex: the current buffer's, or else
+ * a parked buffer's shown in another window. Replay lexes everything right
+ * here instead, so its frames don't depend on thread timing.
+ */
+void editorHighlightStart() {
+  if (H.running) {
+    return;
+  }
+  if (E.syntax && H.next < E.numrows) {
+    H.buf = BL.cur;
+    H.row = E.row;
+    H.numrows = E.numrows;
+    H.syntax = E.syntax;
+    H.at = H.next;
+  } else if (!highlightParked()) {
+    return;
+  }
+  atomic_store(&H.cancel, 0);
+  atomic_store(&H.done, 0);
+  if (R.active) {
+    highlightWorker(NULL);
+    highlightRecord();
+    editorHighlightReap();
+    return;
+  }
+  if (pthread_create(&H.thread, NULL, highlightWorker, NULL) != 0) {
+    highlightWorker(NULL); // no thread: at least get it done
+    highlightRecord();
+    editorHighlightReap();
+    return;
+  }
+  H.running = 1;
+}
 
-  E.numrows++;
+/*
+ * Idle-loop hook: join a finished worker, and ask for a redraw when it
+ * changed what's on screen. Returns 1 if the screen needs a redraw.
+ */
+int editorHighlightPoll() {
+  if (!H.running) {
+    return 0;
+  }
+  int redraw = atomic_exchange(&H.repaint, 0);
+  if (atomic_load(&H.done)) {
+    editorHighlightStop();
+    redraw = 1;
+  }
+  return redraw;
 }
 
-/*** file i/o ***/
+// Map a highlight class to an SGR foreground color (39 for plain text)
+int editorSyntaxToColor(int hl) {
+  switch (hl) {
+    case HL_COMMENT:
+    case HL_MLCOMMENT:
+      return 36; // cyan
+    case HL_KEYWORD1:
+      return 33; // yellow
+    case HL_KEYWORD2:
+      return 32; // green
+    case HL_STRING:
+      return 35; // magenta
+    case HL_NUMBER:
+      return 31; // red
+    default:
+      return 39; // terminal default
+  }
+}
 
 /*
- * Open and read a file into editor state.
- * Stores filename for status bar display.
- * strdup() allocates memory; freed on re-open.
+ * Pick E.syntax from the file name and drop the old highlighting; the
+ * background worker relexes the buffer starting with what's on screen.
  */
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename); // allocates and copies string
+void editorSelectSyntaxHighlight() {
+  editorHighlightStop();
+  E.syntax = NULL;
+  if (E.filename) {
+    char *ext = strrchr(E.filename, '.');
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) {
-    die("fopen");
+    for (unsigned int j = 0; j < HLDB_ENTRIES && !E.syntax; j++) {
+      struct editorSyntax *s = &HLDB[j];
+      for (int i = 0; s->filematch[i]; i++) {
+        int is_ext = (s->filematch[i][0] == '.');
+        if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+            (!is_ext && strstr(E.filename, s->filematch[i]))) {
+          E.syntax = s;
+          break;
+        }
+      }
+    }
   }
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+  for (int i = 0; i < E.numrows; i++) {
+    free(E.row[i].hl);
+    E.row[i].hl = NULL;
+  }
+  H.next = 0;
+}
 
-  // getline() automatically reallocates line buffer as needed
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    // Strip trailing newline/carriage return
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-      linelen--;
+/*** utf-8 ***/
+
+/*
+ * True when none of the `n` bytes at `s` has its top bit set: plain ASCII,
+ * one byte per column. With SSE2 the top bits of 16 bytes OR together and
+ * a single movemask at the end says whether any was set.
+ */
+int utf8IsAscii(const char *s, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(s + i)));
+  }
+  if (_mm_movemask_epi8(acc)) {
+    return 0;
+  }
+#endif
+  for (; i < n; i++) {
+    if ((unsigned char)s[i] & 0x80) {
+      return 0;
     }
+  }
+  return 1;
+}
+
+/*
+ * Decode the UTF-8 sequence at `s` (`n` bytes available) into *cp.
+ * Returns its length, or 0 if it is malformed: a stray continuation byte,
+ * truncated, overlong, a surrogate or past U+10FFFF.
+ */
+int utf8Decode(const char *s, int n, uint32_t *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  uint32_t c;
+  int len;
+
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  } else if (u[0] >= 0xc2 && u[0] <= 0xdf) {
+    c = u[0] & 0x1f;
+    len = 2;
+  } else if ((u[0] & 0xf0) == 0xe0) {
+    c = u[0] & 0x0f;
+    len = 3;
+  } else if (u[0] >= 0xf0 && u[0] <= 0xf4) {
+    c = u[0] & 0x07;
+    len = 4;
+  } else {
+    return 0;
+  }
+  if (n < len) {
+    return 0;
+  }
 
-    editorAppendRow(line, linelen);
+  for (int i = 1; i < len; i++) {
+    if ((u[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    c = (c << 6) | (u[i] & 0x3f);
+  }
+  if ((len == 3 && c < 0x800) || (len == 4 && (c < 0x10000 || c > 0x10ffff)) ||
+      (c >= 0xd800 && c <= 0xdfff)) {
+    return 0;
   }
+  *cp = c;
+  return len;
+}
 
-  free(line);
-  fclose(fp);
+// Encode code point `cp` into `out` (room for 4 bytes), returning the length
+int utf8Encode(uint32_t cp, char *out) {
+  if (cp < 0x80) {
+    out[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    out[0] = 0xc0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  } else if (cp < 0x10000) {
+    out[0] = 0xe0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3f);
+    out[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  }
+  out[0] = 0xf0 | (cp >> 18);
+  out[1] = 0x80 | ((cp >> 12) & 0x3f);
+  out[2] = 0x80 | ((cp >> 6) & 0x3f);
+  out[3] = 0x80 | (cp & 0x3f);
+  return 4;
 }
 
-/*** append buffer ***/
+// Binary search a sorted width table for `cp`
+int widthRangeHas(const struct widthRange *t, int n, uint32_t cp) {
+  int lo = 0, hi = n - 1;
+  if (cp < t[0].first || cp > t[hi].last) {
+    return 0;
+  }
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (cp > t[mid].last) {
+      lo = mid + 1;
+    } else if (cp < t[mid].first) {
+      hi = mid - 1;
+    } else {
+      return 1;
+    }
+  }
+  return 0;
+}
 
 /*
- * Append buffer: dynamically growing string buffer for building output.
- * Avoids many small write() syscalls by collecting bytes in memory first.
- * Pattern: create struct, append pieces, write once, free.
+ * Screen columns code point `cp` takes: 0 for combining marks, 2 for East
+ * Asian wide and fullwidth characters, 1 for everything else (including
+ * control characters, which are drawn as one symbol).
  */
-struct abuf {
-  char *b;
+int utf8Width(uint32_t cp) {
+  if (cp < 0x300) {
+    return 1;
+  }
+  if (widthRangeHas(zeroWidth, WIDTH_ENTRIES(zeroWidth), cp)) {
+    return 0;
+  }
+  if (widthRangeHas(doubleWidth, WIDTH_ENTRIES(doubleWidth), cp)) {
+    return 2;
+  }
+  return 1;
+}
+
+/*
+ * Length of the run of plain bytes at the start of `s` (`n` bytes): ASCII
+ * other than tab, which take exactly one column each. SSE2 tests 16 bytes
+ * at a time for a set top bit or a tab.
+ */
+int utf8PlainRun(const char *s, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i tab = _mm_set1_epi8('\t');
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    unsigned mask = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tab)));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  while (i < n && !((unsigned char)s[i] & 0x80) && s[i] != '\t') {
+    i++;
+  }
+  return i;
+}
+
+/*
+ * Walk the `n` bytes of text at `s` from byte *at, which starts at screen
+ * column `col`, to the first character that starts at or after byte `to`
+ * or at or right of column `tocol`, passing over any combining marks
+ * there. Leaves *at on that character and returns its column. Widths are
+ * the ones rendering gives: tabs to the next tab stop, one column for a
+ * malformed byte.
+ */
+int utf8Advance(const char *s, int n, int *at, int to, int col, int tocol) {
+  int i = *at;
+  while (i < to && col < tocol) {
+    int room = to - i < tocol - col ? to - i : tocol - col;
+    int plain = utf8PlainRun(&s[i], room);
+    i += plain;
+    col += plain;
+    if (plain == room) {
+      continue;
+    }
+
+    uint32_t cp;
+    int len;
+    if (s[i] == '\t') {
+      col += NEXTE_TAB_STOP - col % NEXTE_TAB_STOP;
+      i++;
+    } else if ((len = utf8Decode(&s[i], n - i, &cp)) == 0) {
+      col++;
+      i++;
+    } else {
+      col += utf8Width(cp);
+      i += len;
+    }
+  }
+
+  // Combining marks go with the character before them
+  uint32_t cp;
   int len;
-};
+  while (i > *at && i < n && (len = utf8Decode(&s[i], n - i, &cp)) &&
+         utf8Width(cp) == 0) {
+    i += len;
+  }
+  *at = i;
+  return col;
+}
 
-// Constructor-like initializer for empty append buffer
-#define ABUF_INIT {NULL, 0}
+// Screen columns a row's render text takes
+int editorRowCols(erow *row) {
+  if (row->ext == NULL) {
+    return row->rsize;
+  }
+  if (row->ext->ckpt) {
+    return row->ext->ckpt[row->ext->nckpt - 1].col;
+  }
+  return row->ext->rcol ? row->ext->rcol[row->rsize] : row->rsize;
+}
+
+/*
+ * Index of the first render byte at or right of screen column `col`, or
+ * rsize when the row ends first. A double-width character straddling
+ * `col` is passed over; combining marks go with the character before them.
+ */
+int editorRowColToIdx(erow *row, int col) {
+  if (col <= 0) {
+    return 0;
+  }
+  int *rcol = editorRowRcol(row);
+  if (!rcol) {
+    return col < row->rsize ? col : row->rsize;
+  }
+
+  int lo = 0, hi = row->rsize;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (rcol[mid] < col) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Cursor position of the character after the one at `at`
+int editorRowNextChar(erow *row, int at) {
+  uint32_t cp;
+  int len = utf8Decode(&editorRowChars(row)[at], row->size - at, &cp);
+  return at + (len ? len : 1);
+}
+
+// Cursor position of the character before `at` (a malformed byte counts
+// as a character of its own, the way it is drawn)
+int editorRowPrevChar(erow *row, int at) {
+  char *chars = editorRowChars(row);
+  for (int back = 2; back <= 4 && back <= at; back++) {
+    uint32_t cp;
+    if (utf8Decode(&chars[at - back], back, &cp) == back) {
+      return at - back;
+    }
+  }
+  return at - 1;
+}
+
+/*** soft wrap ***/
+
+/*
+ * Column where the wrap segment after the one starting at column `start`
+ * begins. Segments are a screen wide, except that a double-width character
+ * the right edge would cut in half moves to the next one. The position
+ * after the last character counts as one more column, for the cursor.
+ */
+int wrapNextSeg(erow *row, int start) {
+  int end = start + E.screencols;
+  int *rcol = editorRowRcol(row);
+  if (!rcol) {
+    return end;
+  }
+
+  int i = editorRowColToIdx(row, start);
+  while (i < row->rsize && rcol[i] < end) {
+    int col = rcol[i];
+    int next = i + 1;
+    while (next < row->rsize && rcol[next] == col) {
+      next++;
+    }
+    if (rcol[next] > end && col > start) {
+      return col;
+    }
+    i = next;
+  }
+  return end;
+}
+
+/*
+ * Wrap segment of a row that shows screen column `rx`; *start is set to
+ * the column the segment begins at.
+ */
+int wrapRowSeg(erow *row, int rx, int *start) {
+  if (!editorRowRcol(row)) {
+    *start = rx / E.screencols * E.screencols;
+    return rx / E.screencols;
+  }
+
+  int seg = 0, s = 0, next;
+  while ((next = wrapNextSeg(row, s)) <= rx) {
+    s = next;
+    seg++;
+  }
+  *start = s;
+  return seg;
+}
+
+// Column wrap segment `seg` of a row begins at
+int wrapSegStart(erow *row, int seg) {
+  int s = 0;
+  while (seg-- > 0) {
+    s = wrapNextSeg(row, s);
+  }
+  return s;
+}
+
+// Screen lines a row takes: one per segment, counting the last (possibly
+// empty) one, which is where the cursor goes at the end
+int editorRowHeight(erow *row) {
+  if (!editorRowRcol(row)) {
+    return editorRowCols(row) / E.screencols + 1;
+  }
+  int start;
+  return wrapRowSeg(row, editorRowCols(row), &start) + 1;
+}
+
+// Height of row `i`, 0 past the end (for block bookkeeping)
+long long wrapHeight(int i) {
+  return i < E.numrows ? editorRowHeight(&E.row[i]) : 0;
+}
+
+// Rebuild the Fenwick tree from the block sums: each node adds itself into
+// its parent, O(blocks)
+void wrapBuildTree() {
+  int n = W.nblocks;
+  W.tree = realloc(W.tree, sizeof(*W.tree) * (n + 1));
+  for (int i = 1; i <= n; i++) {
+    W.tree[i] = W.sums[i - 1];
+  }
+  for (int i = 1; i <= n; i++) {
+    int parent = i + (i & -i);
+    if (parent <= n) {
+      W.tree[parent] += W.tree[i];
+    }
+  }
+  W.treevalid = 1;
+}
+
+// Recompute every block from the rows, O(n)
+void wrapBuild() {
+  W.numrows = E.numrows;
+  W.nblocks = (E.numrows + NEXTE_WRAP_BLOCK - 1) / NEXTE_WRAP_BLOCK;
+  W.sums = realloc(W.sums, sizeof(*W.sums) * (W.nblocks + 1));
+  for (int k = 0; k < W.nblocks; k++) {
+    W.sums[k] = 0;
+  }
+  for (int i = 0; i < E.numrows; i++) {
+    W.sums[i / NEXTE_WRAP_BLOCK] += editorRowHeight(&E.row[i]);
+  }
+  W.cols = E.screencols;
+  W.valid = 1;
+  wrapBuildTree();
+}
+
+void wrapEnsure() {
+  if (!W.valid || W.numrows != E.numrows || W.cols != E.screencols) {
+    wrapBuild();
+  } else if (!W.treevalid) {
+    wrapBuildTree();
+  }
+}
+
+// Screen lines taken by the rows before `row`
+long long wrapPrefix(int row) {
+  long long sum = 0;
+  int block = row / NEXTE_WRAP_BLOCK;
+  for (int i = block; i > 0; i -= i & -i) {
+    sum += W.tree[i];
+  }
+  for (int i = block * NEXTE_WRAP_BLOCK; i < row; i++) {
+    sum += editorRowHeight(&E.row[i]);
+  }
+  return sum;
+}
+
+// Row `row` changed height by `delta` screen lines
+void wrapAdd(int row, int delta) {
+  int block = row / NEXTE_WRAP_BLOCK;
+  W.sums[block] += delta;
+  if (W.treevalid) {
+    for (int i = block + 1; i <= W.nblocks; i += i & -i) {
+      W.tree[i] += delta;
+    }
+  }
+}
+
+/*
+ * Row `at` was just inserted (E.row already updated): every block from
+ * its own on takes in one row at the front and loses its last row to the
+ * next block.
+ */
+void wrapInsertRow(int at) {
+  if (!W.valid) {
+    return;
+  }
+  W.numrows++;
+  int nblocks = (W.numrows + NEXTE_WRAP_BLOCK - 1) / NEXTE_WRAP_BLOCK;
+  if (nblocks > W.nblocks) {
+    W.sums = realloc(W.sums, sizeof(*W.sums) * (nblocks + 1));
+    W.sums[W.nblocks] = 0;
+    W.nblocks = nblocks;
+  }
+  for (int k = at / NEXTE_WRAP_BLOCK; k < W.nblocks; k++) {
+    int first = k * NEXTE_WRAP_BLOCK;
+    int in = first > at ? first : at;
+    W.sums[k] += wrapHeight(in) - wrapHeight(first + NEXTE_WRAP_BLOCK);
+  }
+  W.treevalid = 0;
+}
+
+/*
+ * Row `at` of height `height` was just deleted: every block from its own
+ * on loses its first row (or the deleted one) and takes in the next
+ * block's first.
+ */
+void wrapDeleteRow(int at, int height) {
+  if (!W.valid) {
+    return;
+  }
+  W.numrows--;
+  for (int k = at / NEXTE_WRAP_BLOCK; k < W.nblocks; k++) {
+    int first = k * NEXTE_WRAP_BLOCK;
+    long long out = first > at ? wrapHeight(first - 1) : height;
+    W.sums[k] += wrapHeight(first + NEXTE_WRAP_BLOCK - 1) - out;
+  }
+  W.nblocks = (W.numrows + NEXTE_WRAP_BLOCK - 1) / NEXTE_WRAP_BLOCK;
+  W.treevalid = 0;
+}
+
+/*
+ * The file row screen line `line` belongs to, and the segment of the row
+ * it shows in *seg. Lines past the end give E.numrows. Walks down the tree
+ * from the top power of two to the block, then through the block.
+ */
+int wrapLocate(long long line, int *seg) {
+  int pos = 0;
+  int step = 1;
+  while (step * 2 <= W.nblocks) {
+    step *= 2;
+  }
+  for (; step > 0; step /= 2) {
+    if (pos + step <= W.nblocks && W.tree[pos + step] <= line) {
+      pos += step;
+      line -= W.tree[pos];
+    }
+  }
+
+  int end = (pos + 1) * NEXTE_WRAP_BLOCK;
+  if (end > E.numrows) {
+    end = E.numrows;
+  }
+  for (int i = pos * NEXTE_WRAP_BLOCK; i < end; i++) {
+    int height = editorRowHeight(&E.row[i]);
+    if (line < height) {
+      *seg = line;
+      return i;
+    }
+    line -= height;
+  }
+  *seg = 0;
+  return E.numrows;
+}
+
+// Screen line of the cursor counted from the top of the file, and its
+// column within that line
+long long wrapCursorLine(int *x) {
+  int seg = 0, start = 0;
+  if (E.cy < E.numrows) {
+    seg = wrapRowSeg(&E.row[E.cy], E.rx, &start);
+  }
+  *x = E.rx - start;
+  return wrapPrefix(E.cy) + seg;
+}
+
+// Toggle soft wrap (Ctrl-W)
+void editorToggleWrap() {
+  W.enabled = !W.enabled;
+  W.valid = 0;
+  W.offrow = -1; // place the first wrapped screen at E.rowoff
+  E.coloff = 0;
+  editorSetStatusMessage("Soft wrap %s", W.enabled ? "on" : "off");
+}
+
+/*** row operations ***/
+
+// A row's text, NUL-terminated, wherever it is kept
+char *editorRowChars(const erow *row) {
+  return row->size > NEXTE_ROW_INLINE ? row->text.heap : (char *)row->text.inl;
+}
+
+// A row's rendered text: the text itself unless it needed rendering
+char *editorRowRender(const erow *row) {
+  return row->ext ? row->ext->render : editorRowChars(row);
+}
+
+// Screen column of each render byte, or NULL when they are byte offsets
+int *editorRowRcol(const erow *row) {
+  return row->ext ? row->ext->rcol : NULL;
+}
+
+// A long row's checkpoints, NULL for any other row
+struct rowCheckpoint *editorRowCkpt(const erow *row) {
+  return row->ext ? row->ext->ckpt : NULL;
+}
+
+// Free what editorUpdateRow() made of a row's text
+void editorRowFreeRender(erow *row) {
+  if (row->ext) {
+    free(row->ext->rcol);
+    free(row->ext->ckpt);
+    free(row->ext);
+    row->ext = NULL;
+  }
+}
+
+// A rowRender with room for `n` bytes of rendering (plus the NUL)
+struct rowRender *rowRenderNew(size_t n) {
+  struct rowRender *ext = malloc(sizeof(*ext) + n + 1);
+  ext->rcol = NULL;
+  ext->ckpt = NULL;
+  ext->nckpt = 0;
+  ext->render[0] = '\0';
+  return ext;
+}
+
+/*
+ * Render the `n` bytes of text at `s`, which start at screen column `col`,
+ * into `render`, and the screen column of every render byte into `rcol`
+ * (plus the column after the last one). Multi-byte characters are copied
+ * whole and take their display width; combining marks share the column of
+ * the character they follow. Bytes that aren't valid UTF-8 become DEL,
+ * which is drawn as a one-column '?' like other control characters.
+ * Returns the render length.
+ */
+int editorRenderText(const char *s, int n, int col, char *render, int *rcol) {
+  int idx = 0, prev = col;
+  for (int i = 0; i < n;) {
+    if (s[i] == '\t') {
+      do {
+        rcol[idx] = col++;
+        render[idx++] = ' ';
+      } while (col % NEXTE_TAB_STOP != 0);
+      i++;
+      continue;
+    }
+
+    uint32_t cp;
+    int len = utf8Decode(&s[i], n - i, &cp);
+    if (len == 0) {
+      rcol[idx] = prev = col++;
+      render[idx++] = 0x7f;
+      i++;
+      continue;
+    }
+
+    int width = utf8Width(cp);
+    int at = width ? col : prev;
+    while (len--) {
+      rcol[idx] = at;
+      render[idx++] = s[i++];
+    }
+    if (width) {
+      prev = col;
+      col += width;
+    }
+  }
+
+  rcol[idx] = col;
+  return idx;
+}
+
+/*
+ * Convert logical cursor column to rendered column.
+ * Tabs take multiple screen columns but count as one character.
+ */
+int editorRowCxToRx(erow *row, int cx) {
+  char *chars = editorRowChars(row);
+  struct rowCheckpoint *ckpt = editorRowCkpt(row);
+  int *rcol = editorRowRcol(row);
+  if (ckpt) {
+    // Walk from the checkpoint at or before cx
+    int k = cx / NEXTE_LONG_STEP;
+    while (ckpt[k].off > cx) {
+      k--;
+    }
+    int at = ckpt[k].off;
+    return utf8Advance(chars, row->size, &at, cx, ckpt[k].col, INT_MAX);
+  }
+  if (rcol) {
+    // Find the render byte: a tab became the spaces up to the next tab
+    // stop, every other byte is copied, and rcol has its column
+    int idx = 0;
+    for (int j = 0; j < cx; j++) {
+      idx += chars[j] == '\t'
+                 ? NEXTE_TAB_STOP - rcol[idx] % NEXTE_TAB_STOP
+                 : 1;
+    }
+    return rcol[idx];
+  }
+
+  int rx = 0;
+  int j;
+  for (j = 0; j < cx; j++) {
+    if (chars[j] == '\t') {
+      // Tab stops align to every NEXTE_TAB_STOP columns
+      // Calculate spaces needed to reach next tab stop
+      rx += (NEXTE_TAB_STOP - 1) - (rx % NEXTE_TAB_STOP);
+    }
+
+    rx++;
+  }
+  return rx;
+}
+
+/*
+ * Long row: find the first character starting at or right of column `rx`
+ * from the last checkpoint left of it. Returns its offset in chars and
+ * sets *col to its column.
+ */
+int editorLongRowSeek(erow *row, int rx, int *col) {
+  struct rowCheckpoint *ckpt = editorRowCkpt(row);
+  int lo = 0, hi = row->size / NEXTE_LONG_STEP;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (ckpt[mid].col < rx) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  int at = ckpt[lo].off;
+  *col = utf8Advance(editorRowChars(row), row->size, &at, row->size,
+                     ckpt[lo].col, rx);
+  return at;
+}
+
+/*
+ * Render the part of long row `row` that covers screen columns [from, to)
+ * into `win`, a scratch row whose ext and its rcol the caller frees. It
+ * starts far enough left to include a tab reaching into `from`.
+ */
+void editorRowWindow(erow *row, int from, int to, erow *win) {
+  char *chars = editorRowChars(row);
+  int col;
+  int start = editorLongRowSeek(row, from - (NEXTE_TAB_STOP - 1), &col);
+  int end = start;
+  utf8Advance(chars, row->size, &end, row->size, col, to);
+
+  int n = end - start;
+  memset(win, 0, sizeof(*win));
+  win->ext = rowRenderNew(n * NEXTE_TAB_STOP);
+  win->ext->rcol = malloc(sizeof(*win->ext->rcol) * (n * NEXTE_TAB_STOP + 1));
+  win->rsize = editorRenderText(&chars[start], n, col, win->ext->render,
+                                win->ext->rcol);
+}
+
+/*
+ * Convert a rendered column back to a cursor position: the first
+ * character that starts at or right of column `rx`.
+ */
+int editorRowRxToCx(erow *row, int rx) {
+  if (editorRowCkpt(row)) {
+    int col;
+    return editorLongRowSeek(row, rx, &col);
+  }
+
+  char *chars = editorRowChars(row);
+  int *rcol = editorRowRcol(row);
+  int idx = 0;
+  int cx;
+  for (cx = 0; cx < row->size; cx++) {
+    int col = rcol ? rcol[idx] : idx;
+    if (col >= rx) {
+      break;
+    }
+    idx += chars[cx] == '\t' ? NEXTE_TAB_STOP - col % NEXTE_TAB_STOP : 1;
+  }
+  return cx;
+}
+
+/*
+ * Index a long row instead of rendering it: a checkpoint at the first
+ * character boundary from every NEXTE_LONG_STEP bytes, then one at the end
+ * with the total width. Plain ASCII goes 16 bytes per step, so even a
+ * 50 MB line is a quick pass with no copy of the text. Long rows aren't
+ * highlighted, and soft wrap cuts them at exact screen widths.
+ */
+void editorUpdateLongRow(erow *row) {
+  char *chars = editorRowChars(row);
+  int last = row->size / NEXTE_LONG_STEP;
+  struct rowCheckpoint *ckpt = malloc(sizeof(*ckpt) * (last + 2));
+
+  int at = 0, col = 0;
+  for (int k = 0; k <= last; k++) {
+    col = utf8Advance(chars, row->size, &at, k * NEXTE_LONG_STEP, col, INT_MAX);
+    ckpt[k].off = at;
+    ckpt[k].col = col;
+  }
+  ckpt[last + 1].off = row->size;
+  ckpt[last + 1].col =
+      utf8Advance(chars, row->size, &at, row->size, col, INT_MAX);
+
+  row->ext = rowRenderNew(0);
+  row->ext->ckpt = ckpt;
+  row->ext->nckpt = last + 2;
+  row->rsize = 0;
+}
+
+/*
+ * Process tabs in a row: expand them to spaces for display.
+ * Allocates render buffer large enough to hold expanded tabs.
+ * Rows that are pure ASCII (the common case, checked 16 bytes at a time)
+ * keep one column per render byte and no column map, and without tabs
+ * they render as they are, with no copy. Long rows get checkpoints instead
+ * and are rendered a screen at a time when drawn.
+ */
+void editorUpdateRow(erow *row) {
+  int oldheight = editorRowHeight(row);
+  char *chars = editorRowChars(row);
+
+  editorRowFreeRender(row);
+
+  if (row->size > NEXTE_LONG_ROW) {
+    editorUpdateLongRow(row);
+  } else {
+    int tabs = 0;
+    for (int i = 0; i < row->size; i++) {
+      if (chars[i] == '\t') {
+        tabs++;
+      }
+    }
+
+    int ascii = utf8IsAscii(chars, row->size);
+    if (ascii && tabs == 0) {
+      row->rsize = row->size;
+    } else {
+      // Each tab can expand to up to (NEXTE_TAB_STOP - 1) extra spaces
+      size_t cap = row->size + tabs * (NEXTE_TAB_STOP - 1) + 1;
+      row->ext = rowRenderNew(cap - 1);
+      char *render = row->ext->render;
+
+      if (!ascii) {
+        row->ext->rcol = malloc(sizeof(*row->ext->rcol) * cap);
+        row->rsize =
+            editorRenderText(chars, row->size, 0, render, row->ext->rcol);
+        render[row->rsize] = '\0';
+      } else {
+        int idx = 0;
+        for (int i = 0; i < row->size; i++) {
+          if (chars[i] == '\t') {
+            // Convert tab to spaces up to next tab stop
+            render[idx++] = ' ';
+            while (idx % NEXTE_TAB_STOP != 0) {
+              render[idx++] = ' ';
+            }
+          } else {
+            render[idx++] = chars[i];
+          }
+        }
+
+        render[idx] = '\0';
+        row->rsize = idx;
+      }
+    }
+  }
+
+  if (W.valid && row - E.row < W.numrows) {
+    wrapAdd(row - E.row, editorRowHeight(row) - oldheight);
+  }
+  editorUpdateSyntax(row - E.row);
+}
+
+/*
+ * Set up `row` with a copy of `len` bytes at `s`; the render fields are
+ * filled in by editorUpdateRow().
+ */
+void editorInitRow(erow *row, const char *s, size_t len) {
+  row->size = len;
+  row->snapgen = 0;
+  row->origoff = -1;
+  if (len > NEXTE_ROW_INLINE) {
+    row->text.heap = malloc(len + 1);
+  }
+  char *chars = editorRowChars(row);
+  memcpy(chars, s, len);
+  chars[len] = '\0';
+
+  row->rsize = 0;
+  row->ext = NULL;
+  row->hl = NULL;
+  row->hl_start = row->hl_state = HLS_NORMAL;
+}
+
+/*
+ * Insert a new row at index `at` in the editor's row buffer.
+ * Reallocates the row array to fit one more erow struct and shifts the rows
+ * after `at` down by one.
+ */
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows) {
+    return;
+  }
+  // Find-all workers hold a pointer to E.row: stop them before it moves
+  if (FA.running) {
+    editorFindAllStop(1);
+  }
+  editorHighlightStop();
+
+  // Grow array to hold new row (realloc handles NULL for first allocation),
+  // geometrically so loading or following a file appends in O(1)
+  if (E.numrows == E.rowcap) {
+    E.rowcap = E.rowcap ? E.rowcap * 2 : 64;
+    E.row = realloc(E.row, sizeof(erow) * E.rowcap);
+  }
+  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+
+  // The new row gets lexed by editorUpdateRow()
+  editorInitRow(&E.row[at], s, len);
+
+  E.numrows++;
+  E.dirty++;
+  wrapInsertRow(at);
+  // Final rows below it stay final: they moved down one
+  if (at < H.next) {
+    H.next++;
+  }
+
+  editorUpdateRow(&E.row[at]);
+}
+
+// Release the heap buffers owned by a row
+void editorFreeRow(erow *row) {
+  editorRowFreeRender(row);
+  free(row->hl);
+  editorRowReleaseChars(row);
+}
+
+/*
+ * Delete the row at index `at`, shifting the following rows up.
+ */
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows) {
+    return;
+  }
+  if (FA.running) {
+    editorFindAllStop(1);
+  }
+  editorHighlightStop();
+  int height = editorRowHeight(&E.row[at]);
+  editorFreeRow(&E.row[at]);
+  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+  E.numrows--;
+  E.dirty++;
+  wrapDeleteRow(at, height);
+  if (at < H.next) {
+    H.next--;
+  }
+
+  // The row that moved up now follows a different row
+  editorUpdateSyntax(at);
+}
+
+/*
+ * Prepare a row's chars for modification in place: stop find-all and
+ * highlighter workers reading it, detach it from a running save's snapshot
+ * and forget that it matches the original file.
+ */
+void editorRowBeginEdit(erow *row) {
+  if (FA.running) {
+    editorFindAllStop(1);
+  }
+  editorHighlightStop();
+  editorRowUnshare(row);
+  row->origoff = -1;
+}
+
+/*
+ * Give a row's text room for `size` bytes plus the NUL, keeping what fits
+ * of the old text, and move it into or out of the row when it crosses
+ * NEXTE_ROW_INLINE. Returns the text. The row must be editable
+ * (editorRowBeginEdit()).
+ */
+char *editorRowResize(erow *row, int size) {
+  int wasinline = row->size <= NEXTE_ROW_INLINE;
+
+  if (size > NEXTE_ROW_INLINE) {
+    if (wasinline) {
+      char *heap = malloc(size + 1);
+      memcpy(heap, row->text.inl, row->size + 1);
+      row->text.heap = heap;
+    } else {
+      row->text.heap = realloc(row->text.heap, size + 1);
+    }
+  } else if (!wasinline) {
+    char *heap = row->text.heap;
+    memcpy(row->text.inl, heap, size);
+    free(heap);
+  }
+
+  row->size = size;
+  char *chars = editorRowChars(row);
+  chars[size] = '\0';
+  return chars;
+}
+
+/*
+ * Insert character `c` into `row` at index `at` (clamped to end of line).
+ * Grows chars by one byte (+1 for the NUL) and shifts the tail right.
+ */
+void editorRowInsertChar(erow *row, int at, int c) {
+  if (at < 0 || at > row->size) {
+    at = row->size;
+  }
+  editorRowBeginEdit(row);
+  char *chars = editorRowResize(row, row->size + 1);
+  memmove(&chars[at + 1], &chars[at], row->size - 1 - at);
+  chars[at] = c;
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/*
+ * Append `len` bytes of `s` to the end of `row` (used when joining lines).
+ */
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowBeginEdit(row);
+  int old = row->size;
+  char *chars = editorRowResize(row, old + len);
+  memcpy(&chars[old], s, len);
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/*
+ * Delete the character at index `at` in `row`, shifting the tail left.
+ */
+void editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at >= row->size) {
+    return;
+  }
+  editorRowBeginEdit(row);
+  char *chars = editorRowChars(row);
+  memmove(&chars[at], &chars[at + 1], row->size - at - 1);
+  editorRowResize(row, row->size - 1);
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/*
+ * Insert `len` bytes of `s` into `row` at index `at`.
+ */
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+  editorRowBeginEdit(row);
+  int old = row->size;
+  char *chars = editorRowResize(row, old + len);
+  memmove(&chars[at + len], &chars[at], old - at);
+  memcpy(&chars[at], s, len);
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/*
+ * Delete `len` bytes of `row` starting at index `at`.
+ */
+void editorRowDelString(erow *row, int at, int len) {
+  editorRowBeginEdit(row);
+  char *chars = editorRowChars(row);
+  memmove(&chars[at], &chars[at + len], row->size - at - len);
+  editorRowResize(row, row->size - len);
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/*
+ * Split row `at` at byte `col`: the text from col on becomes row at + 1.
+ */
+void editorSplitRow(int at, int col) {
+  erow *row = &E.row[at];
+  char *tail = &editorRowChars(row)[col];
+  // Inline text moves with E.row, which editorInsertRow() may reallocate
+  char copy[NEXTE_ROW_INLINE + 1];
+  if (row->size <= NEXTE_ROW_INLINE) {
+    memcpy(copy, tail, row->size - col);
+    tail = copy;
+  }
+  editorInsertRow(at + 1, tail, row->size - col);
+  // editorInsertRow() may have moved E.row, so look the row up again
+  row = &E.row[at];
+  editorRowBeginEdit(row);
+  editorRowResize(row, col);
+  editorUpdateRow(row);
+}
+
+/*
+ * Join row at + 1 onto the end of row `at`.
+ */
+void editorJoinRow(int at) {
+  erow *next = &E.row[at + 1];
+  editorRowAppendString(&E.row[at], editorRowChars(next), next->size);
+  editorDelRow(at + 1);
+}
+
+/*** undo ***/
+
+#define UNDO_ALIGN(n) (((n) + 7) & ~7)
+
+struct undoRec *undoRecAt(struct undoChunk *c, int off) {
+  return (struct undoRec *)(c->data + off);
+}
+
+char *undoText(struct undoRec *r) { return (char *)(r + 1); }
+
+/*
+ * Find the record just before the cursor. Returns NULL if there is none,
+ * else the record and its chunk/offset.
+ */
+struct undoRec *undoTop(struct undoChunk **chunk, int *off) {
+  struct undoChunk *c = U.cur;
+  int at = U.off;
+
+  // At the start of a chunk the record before is the last of the one before
+  while (c && at == 0) {
+    c = c->prev;
+    at = c ? c->used : 0;
+  }
+  if (c == NULL) {
+    return NULL;
+  }
+  at = (at == c->used) ? c->tail : undoRecAt(c, at)->prev;
+  *chunk = c;
+  *off = at;
+  return undoRecAt(c, at);
+}
+
+// Drop a span's reference to its file, closing the file with the last one
+void undoUnpinFile(int i) {
+  struct undoFile *f = &U.files[i];
+  if (--f->refs == 0) {
+    close(f->fd);
+    f->fd = -1;
+  }
+}
+
+// Release the files pinned by the records at [from, to) of a chunk
+void undoUnpinRecords(struct undoChunk *c, int from, int to) {
+  for (int at = from; at < to; at += undoRecAt(c, at)->size) {
+    struct undoRec *r = undoRecAt(c, at);
+    if (r->span) {
+      struct undoSpan span;
+      memcpy(&span, undoText(r), sizeof(span));
+      undoUnpinFile(span.file);
+    }
+  }
+}
+
+// Free a chunk unlinked from the log
+void undoFreeChunk(struct undoChunk *c) {
+  undoUnpinRecords(c, 0, c->used);
+  U.bytes -= sizeof(*c) + c->cap;
+  free(c);
+}
+
+/*
+ * Make room for a new record of `payload` text bytes at the cursor: drop
+ * everything after it (the redo side), then the oldest chunks if over
+ * NEXTE_UNDO_MAX. Returns the new record, with its header filled in.
+ */
+struct undoRec *undoAppend(int type, int row, int col, int payload) {
+  if (U.cur) {
+    // Cut the log at the cursor
+    while (U.last != U.cur) {
+      struct undoChunk *c = U.last;
+      U.last = c->prev;
+      U.last->next = NULL;
+      undoFreeChunk(c);
+    }
+    if (U.off < U.cur->used) {
+      undoUnpinRecords(U.cur, U.off, U.cur->used);
+      U.cur->tail = undoRecAt(U.cur, U.off)->prev;
+      U.cur->used = U.off;
+    }
+  }
+
+  int need = UNDO_ALIGN(sizeof(struct undoRec) + payload);
+  if (U.cur == NULL || U.cur->used + need > U.cur->cap) {
+    int cap = need > NEXTE_UNDO_CHUNK ? need : NEXTE_UNDO_CHUNK;
+    struct undoChunk *c = malloc(sizeof(*c) + cap);
+    c->cap = cap;
+    c->used = 0;
+    c->tail = -1;
+    c->next = NULL;
+    c->prev = U.last;
+    if (U.last) {
+      U.last->next = c;
+    } else {
+      U.first = c;
+    }
+    U.last = U.cur = c;
+    U.off = 0;
+    U.bytes += sizeof(*c) + cap;
+
+    while (U.bytes > NEXTE_UNDO_MAX && U.first != U.cur) {
+      struct undoChunk *old = U.first;
+      U.first = old->next;
+      U.first->prev = NULL;
+      undoFreeChunk(old);
+    }
+  }
+
+  struct undoRec *r = undoRecAt(U.cur, U.cur->used);
+  r->size = need;
+  r->prev = U.cur->tail;
+  r->step = U.step;
+  r->type = type;
+  r->span = 0;
+  r->row = row;
+  r->col = col;
+  r->len = payload;
+  U.cur->tail = U.cur->used;
+  U.cur->used += need;
+  U.off = U.cur->used;
+  return r;
+}
+
+// Log an edit that carries text (or none)
+void undoRecord(int type, int row, int col, const char *s, int len) {
+  struct undoRec *r = undoAppend(type, row, col, len);
+  if (len > 0) {
+    memcpy(undoText(r), s, len);
+  }
+  U.coalesce = (type == UNDO_INSERT || type == UNDO_DELETE);
+}
+
+/*
+ * Try to grow the record before the cursor by one byte of text, which must
+ * be the last record of the log. Returns it, or NULL if it can't grow.
+ */
+struct undoRec *undoGrow(int type, int row) {
+  struct undoChunk *c;
+  int off;
+  struct undoRec *r = U.coalesce ? undoTop(&c, &off) : NULL;
+
+  if (r == NULL || c != U.last || off != c->tail || r->type != type ||
+      r->row != row || r->len >= NEXTE_UNDO_COALESCE_MAX) {
+    return NULL;
+  }
+  // Not when the record undoes together with the one before it (typing
+  // past the last line also inserts the row): the pair must stay one step
+  struct undoChunk *pc = c;
+  int poff = r->prev;
+  if (poff == -1 && c->prev) {
+    pc = c->prev;
+    poff = pc->tail;
+  }
+  if (poff != -1 && undoRecAt(pc, poff)->step == r->step) {
+    return NULL;
+  }
+  int size = UNDO_ALIGN(sizeof(struct undoRec) + r->len + 1);
+  if (off + size > c->cap) {
+    return NULL;
+  }
+  r->size = size;
+  r->step = U.step;
+  c->used = U.off = off + size;
+  return r;
+}
+
+/*
+ * Log a typed character. Typing coalesces into one record per word: the
+ * first non-blank after a blank starts a new one.
+ */
+void undoInsertChar(int row, int col, char c) {
+  struct undoChunk *ch;
+  int off;
+  struct undoRec *r = U.coalesce ? undoTop(&ch, &off) : NULL;
+
+  if (r && r->type == UNDO_INSERT && r->row == row &&
+      r->col + r->len == col &&
+      !(isspace((unsigned char)undoText(r)[r->len - 1]) &&
+        !isspace((unsigned char)c)) &&
+      undoGrow(UNDO_INSERT, row)) {
+    undoText(r)[r->len++] = c;
+    return;
+  }
+  undoRecord(UNDO_INSERT, row, col, &c, 1);
+}
+
+// Does a word start between adjacent characters `left` and `right`?
+int undoWordStart(char left, char right) {
+  return isspace((unsigned char)left) && !isspace((unsigned char)right);
+}
+
+/*
+ * Log a deleted character. Backspacing (deleting just before the record)
+ * and Delete (deleting at its start) both extend the previous record, a
+ * word at a time like typing: a record doesn't reach across the start of
+ * a word.
+ */
+void undoDeleteChar(int row, int col, char c) {
+  struct undoChunk *ch;
+  int off;
+  struct undoRec *r = U.coalesce ? undoTop(&ch, &off) : NULL;
+
+  if (r && r->type == UNDO_DELETE && r->row == row &&
+      ((col + 1 == r->col && !undoWordStart(c, undoText(r)[0])) ||
+       (col == r->col && !undoWordStart(undoText(r)[r->len - 1], c))) &&
+      undoGrow(UNDO_DELETE, row)) {
+    char *text = undoText(r);
+    if (col + 1 == r->col) {
+      memmove(text + 1, text, r->len);
+      text[0] = c;
+      r->col = col;
+    } else {
+      text[r->len] = c;
+    }
+    r->len++;
+    return;
+  }
+  undoRecord(UNDO_DELETE, row, col, &c, 1);
+}
+
+// Index of the pinned copy of the file `st` describes, or -1
+int undoFindFile(const struct stat *st) {
+  for (int i = 0; i < U.nfiles; i++) {
+    struct undoFile *f = &U.files[i];
+    if (f->fd != -1 && f->st.st_dev == st->st_dev &&
+        f->st.st_ino == st->st_ino) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Pin the current original file for one more span: reuses the pinned copy
+ * if it's the same file, else a free slot. Each span holds a reference, so
+ * a file is closed once the last record pointing into it leaves the log.
+ * Returns its index, or -1.
+ */
+int undoPinFile() {
+  struct stat st;
+  if (!editorOrigValid() || fstat(E.origfd, &st) == -1) {
+    return -1;
+  }
+  int i = undoFindFile(&st);
+  if (i != -1) {
+    U.files[i].refs++;
+    return i;
+  }
+  int fd = dup(E.origfd);
+  if (fd == -1) {
+    return -1;
+  }
+  i = 0;
+  while (i < U.nfiles && U.files[i].fd != -1) {
+    i++;
+  }
+  if (i == U.nfiles) {
+    U.files = realloc(U.files, sizeof(*U.files) * (U.nfiles + 1));
+    U.nfiles++;
+  }
+  U.files[i].fd = fd;
+  U.files[i].refs = 1;
+  U.files[i].st = st;
+  return i;
+}
+
+// Forget all history, e.g. when the rows it refers to are gone
+void undoClear() {
+  while (U.first) {
+    struct undoChunk *c = U.first;
+    U.first = c->next;
+    undoFreeChunk(c);
+  }
+  U.last = U.cur = NULL;
+  U.off = 0;
+  U.coalesce = 0;
+
+  // Freeing the chunks closed every pinned file
+  free(U.files);
+  U.files = NULL;
+  U.nfiles = 0;
+}
+
+/*
+ * Log the deletion of a whole row. A row still identical to the file on
+ * disk is stored as a reference to its bytes there, not a copy.
+ */
+void undoDeleteRow(int at) {
+  erow *row = &E.row[at];
+  struct undoSpan span;
+
+  if (row->origoff != -1 && row->size > (int)sizeof(span) &&
+      (span.file = undoPinFile()) != -1) {
+    span.off = row->origoff;
+    struct undoRec *r = undoAppend(UNDO_DELROW, at, 0, sizeof(span));
+    memcpy(undoText(r), &span, sizeof(span));
+    r->span = 1;
+    r->len = row->size;
+    U.coalesce = 0;
+    return;
+  }
+  undoRecord(UNDO_DELROW, at, 0, editorRowChars(row), row->size);
+}
+
+/*
+ * The text of a record, reading spans back from their file into *buf
+ * (freed by the caller). Returns NULL if the file changed on disk.
+ */
+char *undoFetch(struct undoRec *r, char **buf) {
+  *buf = NULL;
+  if (!r->span) {
+    return undoText(r);
+  }
+
+  struct undoSpan span;
+  struct stat st;
+  memcpy(&span, undoText(r), sizeof(span));
+  struct undoFile *f = &U.files[span.file];
+  if (fstat(f->fd, &st) == -1 || st.st_size != f->st.st_size ||
+      st.st_mtim.tv_sec != f->st.st_mtim.tv_sec ||
+      st.st_mtim.tv_nsec != f->st.st_mtim.tv_nsec) {
+    return NULL;
+  }
+  *buf = malloc(r->len ? r->len : 1);
+  if (pread(f->fd, *buf, r->len, span.off) != r->len) {
+    free(*buf);
+    *buf = NULL;
+    return NULL;
+  }
+  return *buf;
+}
+
+/*
+ * Apply a record backwards (undo) or forwards (redo) and put the cursor
+ * where the edit happened. Returns -1 if a span can't be read back.
+ */
+int undoApply(struct undoRec *r, int undo) {
+  int type = r->type;
+
+  // Undoing an edit is doing its opposite
+  if (undo) {
+    static const int inverse[] = {UNDO_DELETE, UNDO_INSERT, UNDO_JOIN,
+                                  UNDO_SPLIT,  UNDO_DELROW, UNDO_INSROW};
+    type = inverse[type];
+  }
+
+  E.cy = r->row;
+  E.cx = r->col;
+  switch (type) {
+    case UNDO_INSERT: {
+      char *buf;
+      char *text = undoFetch(r, &buf);
+      editorRowInsertString(&E.row[r->row], r->col, text, r->len);
+      free(buf);
+      E.cx = r->col + r->len;
+      break;
+    }
+    case UNDO_DELETE:
+      editorRowDelString(&E.row[r->row], r->col, r->len);
+      break;
+    case UNDO_SPLIT:
+      editorSplitRow(r->row, r->col);
+      E.cy = r->row + 1;
+      E.cx = 0;
+      break;
+    case UNDO_JOIN:
+      editorJoinRow(r->row);
+      break;
+    case UNDO_INSROW: {
+      // An empty row on redo, the deleted row's text on undo
+      char *buf;
+      char *text = r->len ? undoFetch(r, &buf) : (buf = NULL, "");
+      if (text == NULL) {
+        return -1;
+      }
+      editorInsertRow(r->row, text, r->len);
+      // Text read back from the original file still matches it there
+      if (r->span && buf) {
+        struct undoSpan span;
+        memcpy(&span, undoText(r), sizeof(span));
+        struct stat st;
+        if (editorOrigValid() && fstat(E.origfd, &st) == 0 &&
+            st.st_dev == U.files[span.file].st.st_dev &&
+            st.st_ino == U.files[span.file].st.st_ino) {
+          E.row[r->row].origoff = span.off;
+        }
+      }
+      free(buf);
+      break;
+    }
+    case UNDO_DELROW:
+      editorDelRow(r->row);
+      break;
+  }
+  return 0;
+}
+
+/*
+ * Undo the last keypress's worth of edits (Ctrl-Z).
+ */
+void editorUndo() {
+  struct undoChunk *c;
+  int off;
+  struct undoRec *r = undoTop(&c, &off);
+
+  if (r == NULL) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  int step = r->step;
+  do {
+    if (undoApply(r, 1) == -1) {
+      editorSetStatusMessage("Can't undo: the file changed on disk");
+      break;
+    }
+    U.cur = c;
+    U.off = off;
+  } while ((r = undoTop(&c, &off)) && r->step == step);
+  U.coalesce = 0;
+}
+
+/*
+ * Redo what the last undo took back (Ctrl-Y).
+ */
+void editorRedo() {
+  int step = -1;
+
+  while (U.cur) {
+    // Step over to the next chunk at the end of this one
+    if (U.off == U.cur->used) {
+      if (U.cur->next == NULL || U.cur->next->used == 0) {
+        break;
+      }
+      U.cur = U.cur->next;
+      U.off = 0;
+    }
+    struct undoRec *r = undoRecAt(U.cur, U.off);
+    if (step != -1 && r->step != step) {
+      break;
+    }
+    step = r->step;
+    undoApply(r, 0);
+    U.off += r->size;
+  }
+  if (step == -1) {
+    editorSetStatusMessage("Nothing to redo");
+  }
+  U.coalesce = 0;
+}
+
+/*** editor operations ***/
+
+/*
+ * Insert a character at the cursor and advance past it.
+ * Typing on the line after the last one creates that line first.
+ */
+void editorInsertChar(int c) {
+  if (E.cy == E.numrows) {
+    undoRecord(UNDO_INSROW, E.numrows, 0, NULL, 0);
+    editorInsertRow(E.numrows, "", 0);
+  }
+  undoInsertChar(E.cy, E.cx, c);
+  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  E.cx++;
+}
+
+/*
+ * Split the current line at the cursor (Enter).
+ * Text right of the cursor moves to a new line below.
+ */
+void editorInsertNewline() {
+  if (E.cx == 0) {
+    undoRecord(UNDO_INSROW, E.cy, 0, NULL, 0);
+    editorInsertRow(E.cy, "", 0);
+  } else {
+    undoRecord(UNDO_SPLIT, E.cy, E.cx, NULL, 0);
+    editorSplitRow(E.cy, E.cx);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+/*
+ * Delete the character left of the cursor (Backspace).
+ * At the start of a line, joins the line onto the previous one.
+ */
+void editorDelChar() {
+  if (E.cy == E.numrows) {
+    return;
+  }
+  if (E.cx == 0 && E.cy == 0) {
+    return;
+  }
+
+  erow *row = &E.row[E.cy];
+  if (E.cx > 0) {
+    // All the bytes of a multi-byte character, last first
+    int start = editorRowPrevChar(row, E.cx);
+    while (E.cx > start) {
+      undoDeleteChar(E.cy, E.cx - 1, editorRowChars(row)[E.cx - 1]);
+      editorRowDelChar(row, E.cx - 1);
+      E.cx--;
+    }
+  } else {
+    E.cx = E.row[E.cy - 1].size;
+    undoRecord(UNDO_JOIN, E.cy - 1, E.cx, NULL, 0);
+    editorJoinRow(E.cy - 1);
+    E.cy--;
+  }
+}
+
+/*
+ * Delete the cursor's line (Ctrl-K).
+ */
+void editorDelLine() {
+  if (E.cy == E.numrows) {
+    return;
+  }
+  undoDeleteRow(E.cy);
+  editorDelRow(E.cy);
+  E.cx = 0;
+}
+
+/*** file i/o ***/
+
+/*
+ * Add a line read from the file at `offset` (with its newline, if it has
+ * one) as the last row.
+ */
+void editorAppendLine(char *line, size_t rawlen, long long offset) {
+  size_t linelen = rawlen;
+
+  // Strip trailing newline/carriage return
+  while (linelen > 0 &&
+         (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
+    linelen--;
+  }
+
+  editorInsertRow(E.numrows, line, linelen);
+
+  // Only rows ending in a plain '\n' read back exactly as a save writes
+  // them; CRLF rows and an unterminated last line must be rewritten
+  if (rawlen == linelen + 1 && line[linelen] == '\n') {
+    E.row[E.numrows - 1].origoff = offset;
+  }
+}
+
+/*
+ * Open and read a file into editor state.
+ * Stores filename for status bar display.
+ * strdup() allocates memory; freed on re-open.
+ */
+void editorOpen(char *filename) {
+  free(E.filename);
+  E.filename = strdup(filename); // allocates and copies string
+
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    die("fopen");
+  }
+
+  // Keep the file open so saves can copy unchanged rows straight from it;
+  // the descriptor pins this version even once a save renames over it
+  if (E.origfd != -1) {
+    close(E.origfd);
+  }
+  E.origfd = dup(fileno(fp));
+  if (E.origfd != -1 && fstat(E.origfd, &E.origst) == -1) {
+    close(E.origfd);
+    E.origfd = -1;
+  }
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  long long offset = 0;
+  long long complete = 0; // end of the last line with a newline
+
+  // getline() automatically reallocates line buffer as needed
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    editorAppendLine(line, linelen, offset);
+    offset += linelen;
+    if (line[linelen - 1] == '\n') {
+      complete = offset;
+    }
+  }
+
+  free(line);
+  fclose(fp);
+  E.dirty = 0;
+  editorWatchRebase(complete, offset);
+  editorWatchFile();
+
+  // Rows load unlexed; the background worker highlights them
+  editorSelectSyntaxHighlight();
+}
+
+/*
+ * Write `cnt` iovecs to fd, resuming after short writes.
+ * Consumes (modifies) the iovec array. Returns 0 or -1 with errno set.
+ */
+int writevAll(int fd, struct iovec *iov, int cnt) {
+  while (cnt > 0) {
+    ssize_t n = writev(fd, iov, cnt);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    // Skip fully written iovecs, then trim the partially written one
+    while (cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Copy `len` bytes at offset `off` of file `in` to the current position of
+ * `out`, kernel-side: copy_file_range() (reflinks on filesystems that support
+ * it), then sendfile(), then a plain read/write loop as last resort.
+ * Returns 0, or -1 with errno set.
+ */
+int copyFileRange(int in, long long off, int out, long long len) {
+  loff_t inoff = off;
+  int method = 0; // 0 copy_file_range, 1 sendfile, 2 pread + write
+
+  while (len > 0) {
+    ssize_t n;
+
+    if (method == 0) {
+      n = copy_file_range(in, &inoff, out, NULL, len, 0);
+    } else if (method == 1) {
+      off_t sfoff = inoff;
+      n = sendfile(out, in, &sfoff, len);
+      if (n > 0) {
+        inoff = sfoff;
+      }
+    } else {
+      char buf[64 * 1024];
+      n = pread(in, buf,
+                len < (long long)sizeof(buf) ? (size_t)len : sizeof(buf),
+                inoff);
+      if (n > 0) {
+        struct iovec iov = {buf, n};
+        if (writevAll(out, &iov, 1) == -1) {
+          return -1;
+        }
+        inoff += n;
+      }
+    }
+
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // Not supported here (old kernel, cross-device, special file...)
+      if (method < 2 && (errno == ENOSYS || errno == EXDEV ||
+                         errno == EINVAL || errno == EOPNOTSUPP)) {
+        method++;
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      // The original file got shorter under us
+      errno = EIO;
+      return -1;
+    }
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Write every snapshot row followed by '\n' to fd.
+ * Runs of rows still byte-identical to the original file are copied from
+ * job->origfd kernel-side (copyFileRange()); everything else is written with
+ * iovecs pointing straight at the row text (plus one shared newline), flushed
+ * IOV_MAX at a time, so saving never builds a joined copy of the buffer.
+ * Bytes written so far are published to job->written as it goes.
+ * Returns bytes written, or -1 with errno set.
+ */
+long long editorWriteRows(struct saveJob *job, int fd) {
+  static char newline[] = "\n";
+  struct iovec iov[IOV_MAX];
+  int cnt = 0;
+  long long total = 0;
+  struct saveRow *rows = job->rows;
+
+  for (int i = 0; i < job->numrows;) {
+    // Extend a run while each row follows the previous one in the original
+    int end = i;
+    long long runlen = 0;
+    if (job->origfd != -1 && rows[i].origoff != -1) {
+      while (end < job->numrows &&
+             rows[end].origoff == rows[i].origoff + runlen) {
+        runlen += rows[end].size + 1;
+        end++;
+      }
+    }
+
+    if (runlen >= NEXTE_COPY_MIN) {
+      if (cnt > 0 && writevAll(fd, iov, cnt) == -1) {
+        return -1;
+      }
+      cnt = 0;
+      if (copyFileRange(job->origfd, rows[i].origoff, fd, runlen) == -1) {
+        return -1;
+      }
+      total += runlen;
+      job->copied += runlen;
+      atomic_store(&job->written, total);
+      i = end;
+      continue;
+    }
+
+    // Short run (or a changed row): write it from memory
+    if (end == i) {
+      end = i + 1;
+    }
+    for (; i < end; i++) {
+      if (rows[i].size > 0) {
+        iov[cnt].iov_base = rows[i].chars;
+        iov[cnt].iov_len = rows[i].size;
+        cnt++;
+      }
+      iov[cnt].iov_base = newline;
+      iov[cnt].iov_len = 1;
+      cnt++;
+      total += rows[i].size + 1;
+
+      // Always leave room for the next row's text + newline pair
+      if (cnt > IOV_MAX - 2) {
+        if (writevAll(fd, iov, cnt) == -1) {
+          return -1;
+        }
+        cnt = 0;
+        atomic_store(&job->written, total);
+      }
+    }
+  }
+
+  if (cnt > 0 && writevAll(fd, iov, cnt) == -1) {
+    return -1;
+  }
+  atomic_store(&job->written, total);
+  return total;
+}
+
+/*
+ * Save thread body: write the snapshot to the temp file, fsync() and rename
+ * it over the target. Only touches the job, never E, so the UI thread stays
+ * free to edit. Result lands in job->result / job->err, then job->done.
+ * The temp file stays open: on success it becomes the new E.origfd.
+ */
+void *editorSaveThread(void *arg) {
+  struct saveJob *job = arg;
+
+  long long written = -1;
+  if (fchmod(job->fd, job->mode) == 0) {
+    written = editorWriteRows(job, job->fd);
+  }
+  if (written != -1 && fsync(job->fd) == -1) {
+    written = -1;
+  }
+  if (written != -1 && rename(job->tmpname, job->filename) == -1) {
+    written = -1;
+  }
+
+  if (written == -1) {
+    job->err = errno;
+    unlink(job->tmpname);
+  }
+  job->result = written;
+  atomic_store(&job->done, 1);
+  return NULL;
+}
+
+/*
+ * Release a row's text that a running save may still be reading.
+ * Rows in the current snapshot hand their chars to the job, which frees them
+ * once the save thread is done; any other row frees them right away.
+ */
+void editorRowReleaseChars(erow *row) {
+  struct saveJob *job = E.save;
+
+  // Inline text goes with the row (snapshots copy it)
+  if (row->size <= NEXTE_ROW_INLINE) {
+    return;
+  }
+  if (job && row->snapgen == job->gen) {
+    job->retired = realloc(job->retired,
+                           sizeof(*job->retired) * (job->numretired + 1));
+    job->retired[job->numretired++] = row->text.heap;
+  } else {
+    free(row->text.heap);
+  }
+  row->text.heap = NULL;
+  row->snapgen = 0;
+}
+
+/*
+ * Make a row's chars safe to modify in place (copy-on-write).
+ * While a background save holds the row in its snapshot, the first edit
+ * copies just this row's text; untouched rows are never copied.
+ */
+void editorRowUnshare(erow *row) {
+  struct saveJob *job = E.save;
+
+  if (job == NULL || row->snapgen != job->gen) {
+    return;
+  }
+
+  char *copy = malloc(row->size + 1);
+  memcpy(copy, row->text.heap, row->size + 1);
+  editorRowReleaseChars(row);
+  row->text.heap = copy;
+}
+
+/*
+ * Is E.origfd still the text we loaded, so origoff offsets into it hold?
+ * (Compared via the descriptor, i.e. the version we read, not the path.)
+ */
+int editorOrigValid() {
+  struct stat st;
+  return E.origfd != -1 && fstat(E.origfd, &st) == 0 &&
+         st.st_size == E.origst.st_size &&
+         st.st_mtim.tv_sec == E.origst.st_mtim.tv_sec &&
+         st.st_mtim.tv_nsec == E.origst.st_mtim.tv_nsec;
+}
+
+/*
+ * Make the file just saved the new original: every row is now byte-identical
+ * to the new file, at the offset the snapshot wrote it to. Only valid when
+ * the buffer wasn't edited during the save, so rows map 1:1 to the snapshot.
+ */
+void editorRebaseline(struct saveJob *job) {
+  if (E.origfd != -1) {
+    close(E.origfd);
+  }
+  E.origfd = job->fd;
+  if (fstat(E.origfd, &E.origst) == -1) {
+    close(E.origfd);
+    E.origfd = -1;
+  }
+
+  long long offset = 0;
+  for (int i = 0; i < E.numrows; i++) {
+    E.row[i].origoff = E.origfd != -1 ? offset : -1;
+    offset += E.row[i].size + 1;
+  }
+  editorWatchRebase(offset, offset);
+}
+
+/*
+ * Finish a save whose thread has completed: join it, free the text retired
+ * while it ran, and report the result in the status bar.
+ */
+void editorSaveComplete() {
+  struct saveJob *job = E.save;
+
+  pthread_join(job->thread, NULL);
+  E.save = NULL;
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double secs = (end.tv_sec - job->start.tv_sec) +
+                (end.tv_nsec - job->start.tv_nsec) / 1e9;
+
+  if (job->origfd != -1) {
+    close(job->origfd);
+  }
+
+  if (job->result == -1) {
+    close(job->fd);
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+  } else {
+    // Edits made while saving aren't in the file
+    if (E.dirty == job->dirty) {
+      E.dirty = 0;
+      editorRebaseline(job);
+    } else {
+      // Rows still unchanged keep pointing into the old version
+      close(job->fd);
+    }
+    editorWatchSaved();
+    editorSetStatusMessage("%lld bytes written in %.1f ms (%.1f MB/s, "
+                           "%lld copied in kernel)",
+                           job->result, secs * 1e3,
+                           secs > 0 ? job->result / secs / 1e6 : 0.0,
+                           job->copied);
+  }
+
+  for (int i = 0; i < job->numretired; i++) {
+    free(job->retired[i]);
+  }
+  free(job->retired);
+  free(job->rows);
+  free(job->tmpname);
+  free(job->filename);
+  free(job);
+
+  if (E.save_queued) {
+    E.save_queued = 0;
+    editorSave();
+  }
+}
+
+/*
+ * Poll the running save from the idle loop.
+ * Returns 1 if the status message changed and the screen needs a redraw.
+ * Progress is left alone while a prompt owns the message bar.
+ */
+int editorSavePoll() {
+  struct saveJob *job = E.save;
+
+  if (job == NULL || E.prompting) {
+    return 0;
+  }
+  if (atomic_load(&job->done)) {
+    editorSaveComplete();
+    return 1;
+  }
+
+  long long written = atomic_load(&job->written);
+  editorSetStatusMessage("Saving... %d%% (%lld of %lld bytes)",
+                         job->total ? (int)(written * 100 / job->total) : 0,
+                         written, job->total);
+  return 1;
+}
+
+// Block until running and queued saves finish (before quitting)
+void editorSaveWait() {
+  while (E.save) {
+    editorSaveComplete();
+  }
+}
+
+/*
+ * Save the buffer to E.filename in the background.
+ * Takes a snapshot of the row table (text pointers and sizes only, the text
+ * itself is shared) and hands it to a thread that writes it to a temp file in
+ * the same directory, fsync()s it and renames it over the original: readers
+ * see either the old file or the new one, never a half-written mix.
+ * Rows edited during the save are copied on first write (editorRowUnshare()).
+ */
+void editorSave() {
+  // One save at a time: remember to save again once the current one lands
+  if (E.save) {
+    E.save_queued = 1;
+    editorSetStatusMessage("Save queued");
+    return;
+  }
+
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+
+  struct saveJob *job = calloc(1, sizeof(*job));
+  clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+  size_t tmplen = strlen(E.filename) + sizeof(".XXXXXX");
+  job->tmpname = malloc(tmplen);
+  snprintf(job->tmpname, tmplen, "%s.XXXXXX", E.filename);
+
+  job->fd = mkstemp(job->tmpname);
+  if (job->fd == -1) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    free(job->tmpname);
+    free(job);
+    return;
+  }
+
+  // mkstemp() creates 0600; keep the original's mode, or honor the umask
+  struct stat st;
+  if (stat(E.filename, &st) == 0) {
+    job->mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    job->mode = 0666 & ~mask;
+  }
+
+  // Generation 0 means "in no snapshot", so skip it on wraparound
+  static unsigned int savegen = 0;
+  if (++savegen == 0) {
+    savegen = 1;
+  }
+  job->gen = savegen;
+
+  // Copy unchanged rows from the original only if nobody rewrote it since
+  job->origfd = -1;
+  if (editorOrigValid()) {
+    job->origfd = dup(E.origfd);
+  }
+
+  job->numrows = E.numrows;
+  job->rows = malloc(sizeof(*job->rows) * (E.numrows ? E.numrows : 1));
+  for (int i = 0; i < E.numrows; i++) {
+    erow *row = &E.row[i];
+    struct saveRow *snap = &job->rows[i];
+    // Heap text is shared until an edit copies it; inline text is copied
+    if (row->size > NEXTE_ROW_INLINE) {
+      snap->chars = row->text.heap;
+      row->snapgen = job->gen;
+    } else {
+      memcpy(snap->inl, row->text.inl, row->size + 1);
+      snap->chars = snap->inl;
+    }
+    snap->size = row->size;
+    snap->origoff = row->origoff;
+    job->total += row->size + 1;
+  }
+  job->filename = strdup(E.filename);
+  job->dirty = E.dirty;
+  atomic_init(&job->written, 0);
+  atomic_init(&job->done, 0);
+
+  if (pthread_create(&job->thread, NULL, editorSaveThread, job) != 0) {
+    editorSetStatusMessage("Can't save! Thread creation failed");
+    if (job->origfd != -1) {
+      close(job->origfd);
+    }
+    close(job->fd);
+    unlink(job->tmpname);
+    free(job->rows);
+    free(job->tmpname);
+    free(job->filename);
+    free(job);
+    return;
+  }
+
+  E.save = job;
+  editorSetStatusMessage("Saving...");
+}
+
+/*** file watch ***/
+
+/*
+ * The file is loaded up to `end`, its complete lines up to `off`: remember
+ * where reading picks up, and the bytes just before `end` to check that the
+ * file was only appended to when it grows.
+ */
+void editorWatchRebase(long long off, long long end) {
+  T.off = off;
+  T.end = end;
+  T.taillen = end < (long long)sizeof(T.tail) ? end : (long long)sizeof(T.tail);
+  if (E.origfd == -1 ||
+      pread(E.origfd, T.tail, T.taillen, end - T.taillen) != T.taillen) {
+    T.taillen = 0;
+  }
+}
+
+// The file name without its directory
+const char *editorWatchBase() {
+  const char *slash = strrchr(E.filename, '/');
+  return slash ? slash + 1 : E.filename;
+}
+
+/*
+ * Watch the file at E.filename for writes and for being moved or deleted,
+ * and its directory for a new file of that name appearing (an editor
+ * saving by rename, log rotation). Returns -1 if the file can't be watched.
+ */
+int editorWatchFile() {
+  if (E.filename == NULL) {
+    return -1;
+  }
+  if (T.fd == -1) {
+    T.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (T.fd == -1) {
+      return -1;
+    }
+  }
+
+  // Events still queued for the old watches are ignored
+  if (T.wd != -1) {
+    inotify_rm_watch(T.fd, T.wd);
+  }
+  if (T.dirwd != -1) {
+    inotify_rm_watch(T.fd, T.dirwd);
+  }
+
+  // The directory first, so a deleted file is noticed coming back
+  const char *base = editorWatchBase();
+  char dir[PATH_MAX];
+  if (base == E.filename) {
+    snprintf(dir, sizeof(dir), ".");
+  } else {
+    // Keep the slash of "/file"
+    int len = base - E.filename > 1 ? (int)(base - E.filename - 1) : 1;
+    snprintf(dir, sizeof(dir), "%.*s", len, E.filename);
+  }
+  T.dirwd = inotify_add_watch(T.fd, dir, IN_CREATE | IN_MOVED_TO);
+
+  T.wd = inotify_add_watch(T.fd, E.filename,
+                           IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                               IN_DELETE_SELF);
+  return T.wd == -1 ? -1 : 0;
+}
+
+// Collect queued watch events into T.changed / T.moved
+void editorWatchDrain() {
+  _Alignas(struct inotify_event) char buf[4096];
+  const char *base = editorWatchBase();
+  ssize_t n;
+
+  while ((n = read(T.fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->wd == T.wd && ev->wd != -1) {
+        if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+          T.moved = 1;
+        } else {
+          T.changed = 1;
+        }
+        if (ev->mask & IN_IGNORED) {
+          T.wd = -1;
+        }
+      } else if (ev->wd == T.dirwd && ev->wd != -1 && ev->len &&
+                 strcmp(ev->name, base) == 0) {
+        T.moved = 1;
+      }
+      p += sizeof(*ev) + ev->len;
+    }
+  }
+}
+
+/*
+ * Read what was appended to E.origfd since T.off into rows, about
+ * NEXTE_FOLLOW_MAX bytes at most. The unterminated last line, if any, is
+ * read again and its row replaced. Returns 1 if there may be more to read.
+ */
+int editorReadAppended() {
+  if (T.end > T.off) {
+    editorDelRow(E.numrows - 1);
+  }
+
+  char buf[64 * 1024];
+  char *carry = NULL; // start of a line continuing in the next block
+  size_t carrylen = 0, carrycap = 0;
+  long long start = T.off, pos = T.off, linestart = T.off;
+  ssize_t n;
+
+  // Stop at a line boundary past the limit (a longer line is read whole)
+  while (linestart - start < NEXTE_FOLLOW_MAX &&
+         (n = pread(E.origfd, buf, sizeof(buf), pos)) > 0) {
+    char *p = buf, *end = buf + n, *nl;
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+      size_t len = nl + 1 - p;
+      if (carrylen) {
+        if (carrylen + len > carrycap) {
+          carrycap = (carrylen + len) * 2;
+          carry = realloc(carry, carrycap);
+        }
+        memcpy(&carry[carrylen], p, len);
+        editorAppendLine(carry, carrylen + len, linestart);
+        carrylen = 0;
+      } else {
+        editorAppendLine(p, len, linestart);
+      }
+      linestart = pos + (nl + 1 - buf);
+      p = nl + 1;
+    }
+
+    if (end > p) {
+      if (carrylen + (end - p) > carrycap) {
+        carrycap = (carrylen + (end - p)) * 2;
+        carry = realloc(carry, carrycap);
+      }
+      memcpy(&carry[carrylen], p, end - p);
+      carrylen += end - p;
+    }
+    pos += n;
+  }
+
+  if (carrylen) {
+    editorAppendLine(carry, carrylen, linestart);
+  }
+  free(carry);
+  editorWatchRebase(linestart, pos);
+  return linestart - start >= NEXTE_FOLLOW_MAX;
+}
+
+/*
+ * Has the file only grown since it was loaded? Checks the size and the
+ * bytes just before the old end.
+ */
+int editorFileAppended(struct stat *st) {
+  char tail[sizeof(T.tail)];
+  return st->st_size >= T.end &&
+         pread(E.origfd, tail, T.taillen, T.end - T.taillen) == T.taillen &&
+         memcmp(tail, T.tail, T.taillen) == 0;
+}
+
+/*
+ * Where the line ending at `end` of data[lo, end) starts, and the length of
+ * its text without the newline and trailing CRs (as editorAppendLine()
+ * strips them). *plain is set if it ended in just a '\n'.
+ */
+size_t editorReloadLineBefore(const char *data, size_t lo, size_t end,
+                              size_t *len, int *plain) {
+  size_t stop = end;
+  if (data[stop - 1] == '\n') {
+    stop--;
+  }
+  *plain = stop < end;
+  while (stop > lo && data[stop - 1] == '\r') {
+    stop--;
+    *plain = 0;
+  }
+  const char *nl = memrchr(&data[lo], '\n', stop - lo);
+  size_t start = nl ? (size_t)(nl - data) + 1 : lo;
+  *len = stop - start;
+  return start;
+}
+
+/*
+ * A window onto E.origfd for editorReload(): bytes [off, off + len) of the
+ * file are in buf. The file is read with pread() rather than mapped, so one
+ * truncated under the scan (copytruncate) is noticed as a short read
+ * instead of raising SIGBUS.
+ */
+struct reloadWindow {
+  char *buf;
+  size_t cap;
+  long long off;
+  long long len;
+  long long size; // file size when the reload started
+};
+
+/*
+ * Bytes [from, to) of the file, read into the window with at least
+ * NEXTE_RELOAD_BLOCK bytes around them: after `from` scanning forward,
+ * before `to` scanning backward. Returns NULL if the file no longer has
+ * them.
+ */
+const char *reloadFetch(struct reloadWindow *w, long long from, long long to,
+                        int backward) {
+  if (from >= w->off && to <= w->off + w->len) {
+    return &w->buf[from - w->off];
+  }
+  long long lo = from, hi = to;
+  if (hi - lo < NEXTE_RELOAD_BLOCK) {
+    if (backward) {
+      lo = hi > NEXTE_RELOAD_BLOCK ? hi - NEXTE_RELOAD_BLOCK : 0;
+    } else {
+      hi = lo + NEXTE_RELOAD_BLOCK < w->size ? lo + NEXTE_RELOAD_BLOCK
+                                             : w->size;
+    }
+  }
+  if ((size_t)(hi - lo) > w->cap) {
+    w->cap = hi - lo;
+    w->buf = realloc(w->buf, w->cap);
+  }
+  w->len = 0;
+  for (long long got = 0; got < hi - lo;) {
+    ssize_t n = pread(E.origfd, w->buf + got, hi - lo - got, lo + got);
+    if (n <= 0) {
+      return NULL;
+    }
+    got += n;
+  }
+  w->off = lo;
+  w->len = hi - lo;
+  return &w->buf[from - lo];
+}
+
+// Byte `at` of the file, or -1 if it can't be read
+int reloadByte(struct reloadWindow *w, long long at, int backward) {
+  const char *p = reloadFetch(w, at, at + 1, backward);
+  return p ? (unsigned char)*p : -1;
+}
+
+// Does `row` match the file at `at`? 1 or 0, or -1 if it can't be read
+int reloadRowEqual(struct reloadWindow *w, erow *row, long long at,
+                   int backward) {
+  if (row->size == 0) {
+    return 1;
+  }
+  const char *p = reloadFetch(w, at, at + row->size, backward);
+  if (p == NULL) {
+    return -1;
+  }
+  return memcmp(p, editorRowChars(row), row->size) == 0;
+}
+
+/*
+ * Count the rows equal to the lines at the start of the file, setting
+ * their offsets, and where the lines after them start (*pos). Returns -1
+ * if the file shrank meanwhile.
+ */
+int reloadPrefix(struct reloadWindow *w, long long *pos) {
+  long long n = w->size;
+  int pre = 0;
+  *pos = 0;
+  while (pre < E.numrows && *pos < n) {
+    erow *row = &E.row[pre];
+    long long stop = *pos + row->size;
+    if (stop > n) {
+      break;
+    }
+    int eq = reloadRowEqual(w, row, *pos, 0);
+    if (eq != 1) {
+      return eq == -1 ? -1 : pre;
+    }
+    long long nl = stop;
+    int c = nl < n ? reloadByte(w, nl, 0) : '\n';
+    while (c == '\r') {
+      nl++;
+      c = nl < n ? reloadByte(w, nl, 0) : '\n';
+    }
+    if (c == -1) {
+      return -1;
+    }
+    if (c != '\n') {
+      break; // the line goes on
+    }
+    row->origoff = nl == stop && nl < n ? *pos : -1;
+    *pos = nl < n ? nl + 1 : n;
+    pre++;
+  }
+  return pre;
+}
+
+/*
+ * Count the rows before the last that are equal to the lines at the end
+ * of the file, down to `pos`, setting their offsets, and where the lines
+ * before them end (*end). A row matches the line ending at *end when its
+ * text sits just before the newline and CRs and a newline (or `pos`) comes
+ * before it. Returns -1 if the file shrank meanwhile.
+ */
+int reloadSuffix(struct reloadWindow *w, int pre, long long pos,
+                 long long *end) {
+  int suf = 0;
+  *end = w->size;
+  while (suf < E.numrows - pre && *end > pos) {
+    erow *row = &E.row[E.numrows - 1 - suf];
+    long long stop = *end;
+    int c = reloadByte(w, stop - 1, 1);
+    if (c == '\n') {
+      stop--;
+      c = stop > pos ? reloadByte(w, stop - 1, 1) : 0;
+    }
+    int plain = stop < *end;
+    while (c == '\r') {
+      stop--;
+      plain = 0;
+      c = stop > pos ? reloadByte(w, stop - 1, 1) : 0;
+    }
+    if (c == -1) {
+      return -1;
+    }
+    long long start = stop - row->size;
+    if (start < pos) {
+      break;
+    }
+    int eq = reloadRowEqual(w, row, start, 1);
+    c = start > pos ? reloadByte(w, start - 1, 1) : '\n';
+    if (eq == -1 || c == -1) {
+      return -1;
+    }
+    if (!eq || c != '\n') {
+      break;
+    }
+    row->origoff = plain ? start : -1;
+    *end = start;
+    suf++;
+  }
+  return suf;
+}
+
+// Where the text after the file's last newline starts, or -1
+long long reloadLastLine(struct reloadWindow *w) {
+  long long at = w->size;
+  while (at > 0) {
+    long long lo = at > NEXTE_RELOAD_BLOCK ? at - NEXTE_RELOAD_BLOCK : 0;
+    const char *p = reloadFetch(w, lo, at, 1);
+    if (p == NULL) {
+      return -1;
+    }
+    const char *nl = memrchr(p, '\n', at - lo);
+    if (nl) {
+      return lo + (nl - p) + 1;
+    }
+    at = lo;
+  }
+  return 0;
+}
+
+/*
+ * Bring the rows up to date with E.origfd after a change other than an
+ * append: rows equal to the file's lines from the start and from the end
+ * are kept (their file offsets updated), and only the lines between those
+ * replace the rows between, with one move of the row array. The comparison
+ * reads through the file once, a block at a time; only the lines that
+ * changed are read whole. The row work is proportional to what changed.
+ * The cursor stays on its text. Returns 1 if any row changed.
+ *
+ * If the file shrinks under the scan, nothing is replaced and no row keeps
+ * an offset into it; the change that shrank it brings another reload.
+ */
+int editorReload() {
+  struct stat st;
+  if (fstat(E.origfd, &st) == -1) {
+    return 0;
+  }
+  struct reloadWindow w = {NULL, 0, 0, 0, st.st_size};
+  E.origst = st;
+
+  long long pos, end;
+  int pre = reloadPrefix(&w, &pos);
+  int suf = pre == -1 ? -1 : reloadSuffix(&w, pre, pos, &end);
+  long long last = suf == -1 ? -1 : reloadLastLine(&w);
+  free(w.buf);
+
+  // The lines in between replace the rows in between
+  char *data = NULL;
+  if (last != -1 && end > pos) {
+    data = malloc(end - pos);
+    for (long long got = 0; got < end - pos;) {
+      ssize_t n = pread(E.origfd, data + got, end - pos - got, pos + got);
+      if (n <= 0) {
+        last = -1;
+        break;
+      }
+      got += n;
+    }
+  }
+  if (last == -1) {
+    for (int i = 0; i < E.numrows; i++) {
+      E.row[i].origoff = -1;
+    }
+    free(data);
+    T.changed = 1;
+    editorWake();
+    return 0;
+  }
+
+  size_t len = end - pos;
+  int ins = 0;
+  for (size_t p = 0; p < len; ins++) {
+    const char *nl = memchr(&data[p], '\n', len - p);
+    p = nl ? (size_t)(nl - data) + 1 : len;
+  }
+  int del = E.numrows - pre - suf;
+
+  if (ins || del) {
+    if (FA.running) {
+      editorFindAllStop(1);
+    }
+    editorHighlightStop();
+
+    for (int i = pre; i < pre + del; i++) {
+      editorFreeRow(&E.row[i]);
+    }
+    int numrows = E.numrows - del + ins;
+    if (numrows > E.rowcap) {
+      while (E.rowcap < numrows) {
+        E.rowcap = E.rowcap ? E.rowcap * 2 : 64;
+      }
+      E.row = realloc(E.row, sizeof(erow) * E.rowcap);
+    }
+    memmove(&E.row[pre + ins], &E.row[pre + del], sizeof(erow) * suf);
+    E.numrows = numrows;
+
+    // Heights and the lexer's progress past the change start over
+    W.valid = 0;
+    if (H.next > pre) {
+      H.next = pre;
+    }
+    for (size_t i = 0, p = 0; i < (size_t)ins; i++) {
+      const char *nl = memchr(&data[p], '\n', len - p);
+      size_t next = nl ? (size_t)(nl - data) + 1 : len;
+      size_t linelen;
+      int plain;
+      editorReloadLineBefore(data, p, next, &linelen, &plain);
+      editorInitRow(&E.row[pre + i], &data[p], linelen);
+      E.row[pre + i].origoff = plain ? pos + (long long)p : -1;
+      p = next;
+    }
+    for (int i = 0; i < ins; i++) {
+      editorUpdateRow(&E.row[pre + i]);
+    }
+    // Keep the cursor and the view on the same text
+    int oldsuf = E.numrows - suf - (ins - del);
+    if (E.cy >= oldsuf) {
+      E.cy += ins - del;
+    } else if (E.cy >= pre + ins) {
+      E.cy = ins ? pre + ins - 1 : pre;
+    }
+    if (E.rowoff >= oldsuf) {
+      E.rowoff += ins - del;
+    }
+    if (E.cy > E.numrows) {
+      E.cy = E.numrows;
+    }
+    if (E.rowoff > E.cy) {
+      E.rowoff = E.cy;
+    }
+    erow *row = E.cy < E.numrows ? &E.row[E.cy] : NULL;
+    if (E.cx > (row ? row->size : 0)) {
+      E.cx = row ? row->size : 0;
+    }
+    while (row && E.cx > 0 && E.cx < row->size &&
+           (editorRowChars(row)[E.cx] & 0xc0) == 0x80) {
+      E.cx--;
+    }
+
+    // Rows moved: history and search results no longer line up
+    FA.nmatches = 0;
+    S.match_row = -1;
+    undoClear();
+  }
+
+  free(data);
+  editorWatchRebase(last, st.st_size);
+  return ins || del;
+}
+
+/*
+ * Bring the rows up to date after watch events: read what was appended, or
+ * reload what changed (from whatever file the path names now, if it was
+ * replaced). Waits while the buffer has unsaved edits, since the rows
+ * no longer mirror the file. When following, a cursor on the last row
+ * stays on the last row. Returns 1 if the screen needs a redraw.
+ */
+int editorWatchPoll() {
+  if (T.fd == -1) {
+    return 0;
+  }
+  editorWatchDrain();
+  if (!(T.changed || T.moved) || E.prompting || E.save) {
+    return 0;
+  }
+  if (E.dirty) {
+    if (!T.warned) {
+      editorSetStatusMessage("%s changed on disk; keeping your unsaved "
+                             "changes",
+                             editorWatchBase());
+      T.warned = 1;
+    }
+    return 0;
+  }
+  T.warned = 0;
+
+  int last = E.numrows > 0 && E.cy == E.numrows - 1;
+  int moved = T.moved, replaced = 0;
+  T.changed = T.moved = 0;
+
+  // A replaced file: switch to whatever the path names now
+  if (moved) {
+    struct stat st;
+    int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+    if (fd != -1 && fstat(fd, &st) == 0 &&
+        (E.origfd == -1 || st.st_dev != E.origst.st_dev ||
+         st.st_ino != E.origst.st_ino)) {
+      if (E.origfd != -1) {
+        close(E.origfd);
+      }
+      E.origfd = fd;
+      E.origst = st;
+      replaced = 1;
+    } else if (fd != -1) {
+      close(fd);
+    }
+    editorWatchFile();
+  }
+  if (E.origfd == -1) {
+    return 0;
+  }
+
+  // Appends are read as such only when following: a log only grows, but
+  // another file may change in the middle and keep its last bytes
+  struct stat st;
+  int changed = 0;
+  if (fstat(E.origfd, &st) == -1) {
+    return 0;
+  }
+  if (replaced || !T.follow || !editorFileAppended(&st)) {
+    changed = editorReload();
+    if (changed) {
+      editorSetStatusMessage("%s changed on disk: reloaded",
+                             editorWatchBase());
+    }
+  } else if (st.st_size > T.end) {
+    // Keep going next pass if the file grew faster than this one reads
+    if (editorReadAppended()) {
+      T.changed = 1;
+      editorWake();
+    }
+    changed = 1;
+  }
+  E.dirty = 0;
+
+  // Rows left in place still match the file at their offsets, and so do
+  // undo spans pointing into this same file (a reload that moved rows
+  // cleared those)
+  fstat(E.origfd, &E.origst);
+  int pinned = undoFindFile(&E.origst);
+  if (pinned != -1) {
+    U.files[pinned].st = E.origst;
+  }
+
+  if (changed && T.follow && last) {
+    E.cy = E.numrows - 1;
+    E.cx = 0;
+  }
+  return changed || replaced;
+}
+
+/*
+ * Our own save renamed a new file over the path: watch that one, and drop
+ * the events the save itself caused.
+ */
+void editorWatchSaved() {
+  editorWatchFile();
+  if (T.fd != -1) {
+    editorWatchDrain();
+  }
+  T.changed = T.moved = 0;
+}
+
+/*
+ * Start or stop following the file (Ctrl-T). Starting catches up with
+ * whatever was appended since it was loaded.
+ */
+void editorToggleFollow() {
+  if (T.follow) {
+    T.follow = 0;
+    editorSetStatusMessage("Stopped following");
+    return;
+  }
+  if (E.filename == NULL || E.origfd == -1) {
+    editorSetStatusMessage("Nothing to follow: no file on disk");
+    return;
+  }
+  if (T.wd == -1 && editorWatchFile() == -1) {
+    editorSetStatusMessage("Can't follow: %s", strerror(errno));
+    return;
+  }
+
+  T.follow = 1;
+  T.changed = 1;
+  editorWatchPoll();
+  editorSetStatusMessage("Following %s (Ctrl-T to stop)", editorWatchBase());
+}
+
+/*** buffers ***/
+
+// Save the current buffer's state from the globals into `b`
+void editorBufferStore(struct editorBuffer *b) {
+  b->cx = E.cx;
+  b->cy = E.cy;
+  b->rx = E.rx;
+  b->rowoff = E.rowoff;
+  b->coloff = E.coloff;
+  b->numrows = E.numrows;
+  b->row = E.row;
+  b->rowcap = E.rowcap;
+  b->filename = E.filename;
+  b->syntax = E.syntax;
+  b->dirty = E.dirty;
+  b->origfd = E.origfd;
+  b->origst = E.origst;
+  b->hlnext = H.next;
+  b->undo = U;
+  b->wrap = W;
+  b->watch = T;
+}
+
+/*
+ * Make `b` the current buffer. Wrap may have been toggled while it was
+ * parked, and its file may have changed: both are noticed without reading
+ * it (the watch is re-armed, since watches are shared with other buffers
+ * of the same directory and may be gone).
+ */
+void editorBufferLoad(const struct editorBuffer *b) {
+  E.cx = b->cx;
+  E.cy = b->cy;
+  E.rx = b->rx;
+  E.rowoff = b->rowoff;
+  E.coloff = b->coloff;
+  E.numrows = b->numrows;
+  E.row = b->row;
+  E.rowcap = b->rowcap;
+  E.filename = b->filename;
+  E.syntax = b->syntax;
+  E.dirty = b->dirty;
+  E.origfd = b->origfd;
+  E.origst = b->origst;
+  H.next = b->hlnext;
+  U = b->undo;
+
+  int enabled = W.enabled;
+  W = b->wrap;
+  if (W.enabled != enabled) {
+    W.enabled = enabled;
+    W.valid = 0;
+    W.offrow = -1;
+    E.coloff = 0;
+  }
+
+  int fd = T.fd;
+  T = b->watch;
+  T.fd = fd;
+  if (E.filename) {
+    struct stat st;
+    if (stat(E.filename, &st) == -1 || st.st_dev != E.origst.st_dev ||
+        st.st_ino != E.origst.st_ino) {
+      T.moved = 1;
+    } else if (!editorOrigValid()) {
+      T.changed = 1;
+    }
+    editorWatchFile();
+  }
+}
+
+// Empty the globals for a new buffer, keeping what buffers share
+void editorBufferReset() {
+  E.cx = E.cy = E.rx = 0;
+  E.rowoff = E.coloff = 0;
+  E.numrows = 0;
+  E.row = NULL;
+  E.rowcap = 0;
+  E.filename = NULL;
+  E.syntax = NULL;
+  E.dirty = 0;
+  E.origfd = -1;
+  H.next = 0;
+  memset(&U, 0, sizeof(U));
+
+  int enabled = W.enabled;
+  memset(&W, 0, sizeof(W));
+  W.enabled = enabled;
+  W.offrow = -1;
+
+  int fd = T.fd;
+  memset(&T, 0, sizeof(T));
+  T.fd = fd;
+  T.wd = T.dirwd = -1;
+}
+
+/*
+ * Nothing may hold on to the current buffer's rows while it's parked:
+ * no save writing them, no worker reading them. Returns 0 if it can't be
+ * left yet.
+ */
+int editorBufferLeave() {
+  if (E.save) {
+    editorSetStatusMessage("Wait for the save to finish");
+    return 0;
+  }
+  if (FA.running) {
+    editorFindAllStop(1);
+  }
+  editorHighlightStop();
+  FA.nmatches = 0;
+  S.match_row = -1;
+  return 1;
+}
+
+// Show the buffer now current: say which, and keep the screen from scrolling
+void editorBufferShown() {
+  V.top = W.enabled ? W.off : E.rowoff;
+  editorSetStatusMessage("Buffer %d of %d: %s", BL.cur + 1, BL.num,
+                         E.filename ? E.filename : "[No Name]");
+}
+
+/*
+ * Switch to buffer `n` (Ctrl-B cycles). Rows, their renders and
+ * highlighting stay where they are: only the state in the globals is
+ * swapped.
+ */
+void editorSwitchBuffer(int n) {
+  if (n == BL.cur || n < 0 || n >= BL.num || !editorBufferLeave()) {
+    return;
+  }
+  editorBufferStore(&BL.bufs[BL.cur]);
+  editorBufferLoad(&BL.bufs[n]);
+  BL.cur = n;
+  editorBufferShown();
+}
+
+/*
+ * Start a new, empty buffer after the others and make it current. The
+ * caller has left the current one (editorBufferLeave()).
+ */
+void editorBufferAdd() {
+  if (BL.num >= BL.cap) {
+    BL.cap = BL.num * 2;
+    BL.bufs = realloc(BL.bufs, sizeof(*BL.bufs) * BL.cap);
+  }
+  editorBufferStore(&BL.bufs[BL.cur]);
+  editorBufferReset();
+  BL.cur = BL.num++;
+}
+
+/*
+ * Open a file in a buffer of its own (Ctrl-O), or switch to the buffer
+ * that has it already. A file that doesn't exist yet gets an empty buffer
+ * and is created by the first save.
+ */
+void editorOpenBuffer() {
+  char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+  if (filename == NULL) {
+    return;
+  }
+
+  struct stat st;
+  int exists = stat(filename, &st) == 0;
+  for (int i = 0; i < BL.num; i++) {
+    const char *name = i == BL.cur ? E.filename : BL.bufs[i].filename;
+    const struct stat *ost = i == BL.cur ? &E.origst : &BL.bufs[i].origst;
+    int origfd = i == BL.cur ? E.origfd : BL.bufs[i].origfd;
+    if ((name && strcmp(name, filename) == 0) ||
+        (exists && origfd != -1 && ost->st_dev == st.st_dev &&
+         ost->st_ino == st.st_ino)) {
+      free(filename);
+      editorSwitchBuffer(i);
+      return;
+    }
+  }
+
+  // editorOpen() gives up on files it can't read: check first
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1 && errno != ENOENT) {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    free(filename);
+    return;
+  }
+  if (!editorBufferLeave()) {
+    if (fd != -1) {
+      close(fd);
+    }
+    free(filename);
+    return;
+  }
+
+  editorBufferAdd();
+  if (fd != -1) {
+    close(fd);
+    editorOpen(filename);
+  } else {
+    E.filename = strdup(filename);
+    editorSelectSyntaxHighlight();
+  }
+  free(filename);
+  editorBufferShown();
+}
+
+// Does any buffer have unsaved changes?
+int editorBuffersDirty() {
+  for (int i = 0; i < BL.num; i++) {
+    if (i == BL.cur ? E.dirty : BL.bufs[i].dirty) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Close the current buffer (Ctrl-X) and free what it holds; the next one
+ * becomes current. Closing the only buffer leaves an empty one.
+ */
+void editorCloseBuffer() {
+  if (!editorBufferLeave()) {
+    return;
+  }
+
+  for (int i = 0; i < E.numrows; i++) {
+    editorFreeRow(&E.row[i]);
+  }
+  free(E.row);
+  free(E.filename);
+  if (E.origfd != -1) {
+    close(E.origfd);
+  }
+  undoClear();
+  free(W.sums);
+  free(W.tree);
+  if (T.wd != -1) {
+    inotify_rm_watch(T.fd, T.wd);
+  }
+  if (T.dirwd != -1) {
+    inotify_rm_watch(T.fd, T.dirwd);
+  }
+
+  if (BL.num <= 1) {
+    editorBufferReset();
+    editorSetStatusMessage("Buffer closed");
+    return;
+  }
+  int closed = BL.cur;
+  BL.num--;
+  memmove(&BL.bufs[BL.cur], &BL.bufs[BL.cur + 1],
+          sizeof(*BL.bufs) * (BL.num - BL.cur));
+  if (BL.cur == BL.num) {
+    BL.cur = 0;
+  }
+  editorWindowsBufferClosed(closed);
+  editorBufferLoad(&BL.bufs[BL.cur]);
+  editorBufferShown();
+}
+
+/*** windows ***/
+
+// Save the focused window's viewport and screen state from the globals
+void editorWindowStore(struct editorWindow *w) {
+  w->cx = E.cx;
+  w->cy = E.cy;
+  w->rx = E.rx;
+  w->rowoff = E.rowoff;
+  w->coloff = E.coloff;
+  w->wrapoff = W.off;
+  w->wrapoffrow = W.offrow;
+  w->wrapoffseg = W.offseg;
+  w->screen = V;
+  w->bar = B;
+}
+
+/*
+ * Put `w`'s viewport, size and screen state in the globals. Its buffer's
+ * state is the caller's business; the message bar is everyone's.
+ */
+void editorWindowLoad(const struct editorWindow *w) {
+  E.cx = w->cx;
+  E.cy = w->cy;
+  E.rx = w->rx;
+  E.rowoff = w->rowoff;
+  E.coloff = w->coloff;
+  E.screenrows = w->rows - 1;
+  E.screencols = w->cols;
+  E.winy = w->y;
+  E.winx = w->x;
+  W.off = w->wrapoff;
+  W.offrow = w->wrapoffrow;
+  W.offseg = w->wrapoffseg;
+  int message = V.message;
+  V = w->screen;
+  V.message = message;
+  B = w->bar;
+}
+
+// The first window of node `n` in layout order (top/left first)
+int editorWindowFirst(int n) {
+  while (WN.nodes[n].split != SPLIT_NONE) {
+    n = WN.nodes[n].child[0];
+  }
+  return n;
+}
+
+// The window after window `n` in layout order, wrapping around
+int editorWindowNext(int n) {
+  int p = WN.nodes[n].parent;
+  while (p != -1 && WN.nodes[p].child[1] == n) {
+    n = p;
+    p = WN.nodes[n].parent;
+  }
+  return editorWindowFirst(p == -1 ? WN.root : WN.nodes[p].child[1]);
+}
+
+/*
+ * Give node `n` the area `rows` by `cols` at (y, x) and share it out among
+ * its children: halves, less a divider column between side by side ones.
+ */
+void editorWindowPlace(int n, int y, int x, int rows, int cols) {
+  struct editorWindow *w = &WN.nodes[n];
+  w->y = y;
+  w->x = x;
+  w->rows = rows;
+  w->cols = cols;
+  // A window's top restarts at the start of its top row
+  w->wrapoffrow = -1;
+  w->wrapoffseg = 0;
+
+  if (w->split == SPLIT_ROWS) {
+    int top = rows / 2;
+    editorWindowPlace(w->child[0], y, x, top, cols);
+    editorWindowPlace(w->child[1], y + top, x, rows - top, cols);
+  } else if (w->split == SPLIT_COLS) {
+    int left = (cols - 1) / 2;
+    editorWindowPlace(w->child[0], y, x, rows, left);
+    editorWindowPlace(w->child[1], y, x + left + 1, rows, cols - left - 1);
+  }
+}
+
+/*
+ * Lay the windows out again over everything but the message bar, after a
+ * split or a close. Every window is redrawn.
+ */
+void editorWindowLayout() {
+  editorWindowStore(&WN.nodes[WN.cur]);
+  editorWindowPlace(WN.root, 0, 0, E.termrows - 1, E.termcols);
+  editorWindowLoad(&WN.nodes[WN.cur]);
+  editorScreenInvalidate();
+}
+
+// A node from the free ones, or a new one; the array may move
+int editorWindowAlloc() {
+  int n = 0;
+  while (n < WN.num && WN.nodes[n].used) {
+    n++;
+  }
+  if (n == WN.num) {
+    if (WN.num == WN.cap) {
+      WN.cap = WN.cap ? WN.cap * 2 : 4;
+      WN.nodes = realloc(WN.nodes, sizeof(*WN.nodes) * WN.cap);
+    }
+    WN.num++;
+  }
+  memset(&WN.nodes[n], 0, sizeof(WN.nodes[n]));
+  WN.nodes[n].used = 1;
+  return n;
+}
+
+/*
+ * Split the focused window in two (Ctrl-E s: one above the other, Ctrl-E v:
+ * side by side). Both show its buffer from the same place; the focus stays
+ * in the top/left one, which keeps the screen cache.
+ */
+void editorWindowSplit(int split) {
+  struct editorWindow *w = &WN.nodes[WN.cur];
+  if ((split == SPLIT_ROWS && w->rows < 4) ||
+      (split == SPLIT_COLS && w->cols < 3)) {
+    editorSetStatusMessage("Window too small to split");
+    return;
+  }
+
+  struct editorWindow view = *w;
+  editorWindowStore(&view);
+  view.buf = BL.cur;
+  int n = WN.cur;
+  int a = editorWindowAlloc();
+  int b = editorWindowAlloc();
+
+  WN.nodes[a] = view;
+  WN.nodes[a].parent = n;
+  WN.nodes[b] = view;
+  WN.nodes[b].parent = n;
+  memset(&WN.nodes[b].screen, 0, sizeof(WN.nodes[b].screen));
+  memset(&WN.nodes[b].bar, 0, sizeof(WN.nodes[b].bar));
+
+  w = &WN.nodes[n];
+  w->split = split;
+  w->child[0] = a;
+  w->child[1] = b;
+  memset(&w->screen, 0, sizeof(w->screen));
+  memset(&w->bar, 0, sizeof(w->bar));
+
+  WN.cur = a;
+  editorWindowLayout();
+}
+
+/*
+ * Edits made in another window may have left this one's cursor and top
+ * past the text: pull them back.
+ */
+void editorWindowClamp() {
+  if (E.cy > E.numrows) {
+    E.cy = E.numrows;
+  }
+  if (E.rowoff > E.numrows) {
+    E.rowoff = E.numrows;
+  }
+  erow *row = E.cy < E.numrows ? &E.row[E.cy] : NULL;
+  if (E.cx > (row ? row->size : 0)) {
+    E.cx = row ? row->size : 0;
+  }
+  while (row && E.cx > 0 && E.cx < row->size &&
+         (editorRowChars(row)[E.cx] & 0xc0) == 0x80) {
+    E.cx--;
+  }
+}
+
+/*
+ * Move the focus to window `n`, making its buffer current. Returns 0 if
+ * the buffer can't be switched to yet.
+ */
+int editorWindowFocus(int n) {
+  if (n == WN.cur) {
+    return 1;
+  }
+  editorWindowStore(&WN.nodes[WN.cur]);
+  WN.nodes[WN.cur].buf = BL.cur;
+  int buf = WN.nodes[n].buf;
+  if (buf != BL.cur) {
+    editorSwitchBuffer(buf);
+    if (buf != BL.cur) {
+      return 0;
+    }
+  }
+  WN.cur = n;
+  editorWindowLoad(&WN.nodes[n]);
+  editorWindowClamp();
+
+  // The wrap index is the buffer's: find this window's top line in it
+  if (W.enabled) {
+    wrapEnsure();
+    W.off = wrapPrefix(E.rowoff) + W.offseg;
+    W.offrow = E.rowoff;
+  }
+  return 1;
+}
+
+
+/*
+ * Close the focused window (Ctrl-E c): the window split off beside it takes
+ * its place, and the focus moves there.
+ */
+void editorWindowClose() {
+  int n = WN.cur;
+  int p = WN.nodes[n].parent;
+  if (p == -1) {
+    editorSetStatusMessage("Only one window");
+    return;
+  }
+  int sibling = WN.nodes[p].child[WN.nodes[p].child[0] == n];
+  int next = editorWindowFirst(sibling);
+  if (WN.nodes[next].buf != BL.cur) {
+    editorSwitchBuffer(WN.nodes[next].buf);
+    if (WN.nodes[next].buf != BL.cur) {
+      return;
+    }
+  }
+
+  // The globals hold this window's caches
+  free(V.lines);
+  free(B.status);
+
+  int gp = WN.nodes[p].parent;
+  WN.nodes[sibling].parent = gp;
+  if (gp == -1) {
+    WN.root = sibling;
+  } else {
+    WN.nodes[gp].child[WN.nodes[gp].child[1] == p] = sibling;
+  }
+  WN.nodes[n].used = WN.nodes[p].used = 0;
+
+  WN.cur = next;
+  editorWindowLoad(&WN.nodes[next]);
+  editorWindowClamp();
+  editorWindowLayout();
+}
+
+/*
+ * Buffer `closed` was closed and BL.cur shows in its place: windows that
+ * showed it show BL.cur now, and the buffers after it moved down one.
+ */
+void editorWindowsBufferClosed(int closed) {
+  for (int i = 0; i < WN.num; i++) {
+    struct editorWindow *w = &WN.nodes[i];
+    if (!w->used || w->split != SPLIT_NONE || i == WN.cur) {
+      continue;
+    }
+    if (w->buf == closed) {
+      w->buf = BL.cur;
+    } else if (w->buf > closed) {
+      w->buf--;
+    }
+  }
+}
+
+/*
+ * Window commands, after the Ctrl-E prefix: s splits the window into one
+ * above the other, v side by side, w moves to the next window and c
+ * closes this one.
+ */
+void editorWindowCommand() {
+  editorSetStatusMessage("Window: s = split, v = side by side, w = next, "
+                         "c = close");
+  editorRefreshScreen();
+
+  int c = editorReadKey();
+  editorSetStatusMessage("");
+  switch (c) {
+    case 's':
+      editorWindowSplit(SPLIT_ROWS);
+      break;
+    case 'v':
+      editorWindowSplit(SPLIT_COLS);
+      break;
+    case 'w':
+      editorWindowFocus(editorWindowNext(WN.cur));
+      break;
+    case 'c':
+      editorWindowClose();
+      break;
+  }
+}
+
+/*** append buffer ***/
+
+// A piece of output appended by reference: `len` bytes at `s`, going
+// after the first `at` copied bytes
+struct abufRef {
+  const char *s;
+  int len;
+  int at;
+};
+
+/*
+ * Append buffer: dynamically growing string buffer for building output.
+ * Avoids many small write() syscalls by collecting bytes in memory first.
+ * Pattern: create struct, append pieces, write once, free.
+ *
+ * Output can also refer to text that stays put until it is written (row
+ * render buffers) instead of copying it: `refs` records where such pieces
+ * go between the copied bytes, and abWrite() sends the lot with writev().
+ */
+struct abuf {
+  char *b;
+  int len;
+  int cap;
+  struct abufRef *refs; // referenced pieces, in output order
+  int nrefs;
+  int caprefs;
+  void **owned;         // buffers freed along with the output
+  int nowned;
+};
+
+// Constructor-like initializer for empty append buffer
+#define ABUF_INIT {NULL, 0, 0, NULL, 0, 0, NULL, 0}
+
+// A position in an append buffer to hash from or cut back to
+struct abufMark {
+  int len;
+  int nrefs;
+  int lastlen; // length of the last piece then, which may still grow
+  int nowned;
+};
+
+/*
+ * Append string `s` of length `len` to buffer `ab`.
+ * Grows the buffer geometrically, copies data into position.
+ * Silently fails (no-op) if realloc returns NULL (out of memory).
+ */
+void abAppend(struct abuf *ab, const char *s, int len) {
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap : 256;
+    while (cap < ab->len + len) {
+      cap *= 2;
+    }
+    char *new = realloc(ab->b, cap);
+    if (new == NULL) {
+      return;
+    }
+    ab->b = new;
+    ab->cap = cap;
+  }
+
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+}
+
+/*
+ * Append `len` bytes at `s` without copying them: the memory must stay
+ * unchanged until the buffer is written. Short pieces are copied anyway,
+ * and so is everything once a frame has as many pieces as one writev()
+ * takes. A piece continuing the previous one extends it.
+ */
+void abAppendRef(struct abuf *ab, const char *s, int len) {
+  struct abufRef *last = ab->nrefs ? &ab->refs[ab->nrefs - 1] : NULL;
+  if (last && last->at == ab->len && last->s + last->len == s) {
+    last->len += len;
+    return;
+  }
+  if (len < NEXTE_IOV_MIN || ab->nrefs >= IOV_MAX / 2 - 1) {
+    abAppend(ab, s, len);
+    return;
+  }
+
+  if (ab->nrefs == ab->caprefs) {
+    ab->caprefs = ab->caprefs ? ab->caprefs * 2 : 64;
+    ab->refs = realloc(ab->refs, sizeof(*ab->refs) * ab->caprefs);
+  }
+  ab->refs[ab->nrefs].s = s;
+  ab->refs[ab->nrefs].len = len;
+  ab->refs[ab->nrefs].at = ab->len;
+  ab->nrefs++;
+}
+
+// The current end of the buffer, for abHashSince() and abTruncate()
+struct abufMark abMark(struct abuf *ab) {
+  struct abufMark m = {ab->len, ab->nrefs,
+                       ab->nrefs ? ab->refs[ab->nrefs - 1].len : 0,
+                       ab->nowned};
+  return m;
+}
+
+// 64-bit FNV-1a over `len` bytes, continuing from hash `h`
+uint64_t hashBytes(uint64_t h, const char *s, int len) {
+  for (int i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/*
+ * Hash of the output appended since mark `m`, in output order. A piece
+ * that grew past the mark can only have done so before anything else was
+ * appended, so its new bytes come first.
+ */
+uint64_t abHashSince(struct abuf *ab, struct abufMark m) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  if (m.nrefs) {
+    struct abufRef *last = &ab->refs[m.nrefs - 1];
+    h = hashBytes(h, last->s + m.lastlen, last->len - m.lastlen);
+  }
+
+  int from = m.len;
+  for (int i = m.nrefs; i <= ab->nrefs; i++) {
+    int at = i < ab->nrefs ? ab->refs[i].at : ab->len;
+    h = hashBytes(h, &ab->b[from], at - from);
+    from = at;
+    if (i < ab->nrefs) {
+      h = hashBytes(h, ab->refs[i].s, ab->refs[i].len);
+    }
+  }
+  return h;
+}
+
+// Drop everything appended since mark `m`
+void abTruncate(struct abuf *ab, struct abufMark m) {
+  for (int i = m.nowned; i < ab->nowned; i++) {
+    free(ab->owned[i]);
+  }
+  ab->nowned = m.nowned;
+  ab->len = m.len;
+  ab->nrefs = m.nrefs;
+  if (m.nrefs) {
+    ab->refs[m.nrefs - 1].len = m.lastlen;
+  }
+}
+
+// Hand `p` (malloc'd, possibly referenced) to the buffer to free
+void abKeep(struct abuf *ab, void *p) {
+  ab->owned = realloc(ab->owned, sizeof(*ab->owned) * (ab->nowned + 1));
+  ab->owned[ab->nowned++] = p;
+}
+
+/*
+ * Send the buffer to the terminal: copied bytes and referenced pieces in
+ * order, as one iovec list.
+ */
+void abWrite(struct abuf *ab) {
+  struct iovec iov[IOV_MAX];
+  int cnt = 0, from = 0;
+
+  for (int i = 0; i <= ab->nrefs; i++) {
+    int at = i < ab->nrefs ? ab->refs[i].at : ab->len;
+    if (at > from) {
+      iov[cnt].iov_base = &ab->b[from];
+      iov[cnt++].iov_len = at - from;
+      from = at;
+    }
+    if (i < ab->nrefs) {
+      iov[cnt].iov_base = (void *)ab->refs[i].s;
+      iov[cnt++].iov_len = ab->refs[i].len;
+    }
+  }
+  editorWriteOutputv(iov, cnt);
+}
+
+/*
+ * Empty the buffer for the next frame, keeping its memory.
+ */
+void abReset(struct abuf *ab) {
+  for (int i = 0; i < ab->nowned; i++) {
+    free(ab->owned[i]);
+  }
+  ab->nowned = 0;
+  ab->len = 0;
+  ab->nrefs = 0;
+}
+
+/*
+ * Free dynamically allocated buffer memory.
+ * Called after write() to prevent memory leaks.
+ */
+void abFree(struct abuf *ab) {
+  abReset(ab);
+  free(ab->b);
+  free(ab->refs);
+  free(ab->owned);
+}
+
+/*** regex ***/
+
+/*
+ * Regular expressions for search: a Thompson NFA compiled once per pattern
+ * and run as a lazily built DFA.
+ * Syntax: literals, . [set] [^set] \d \w \s (and \D \W \S), * + ?, |, (),
+ * ^ and $ (start/end of line). Any other escaped byte is literal.
+ */
+
+// NFA state types. Byte states consume one byte in class `cls`; the rest
+// are epsilon moves (split, empty) or zero-width assertions (bol, eol)
+enum rxType { RX_BYTE, RX_SPLIT, RX_EMPTY, RX_BOL, RX_EOL, RX_MATCH };
+
+struct rxState {
+  int type;
+  int out, out1; // next state(s), -1 = none
+  int cls;       // RX_BYTE: index into regex.classes
+};
+
+struct regex {
+  struct rxState *states;
+  int nstates;
+  int start;
+  unsigned char (*classes)[32]; // 256-bit byte sets for RX_BYTE states
+  int nclasses;
+  char *literal;                // substring every match contains (or NULL)
+  int litlen;
+};
+
+// Parser state; fragments are a start state plus the list of dangling
+// `out` fields that get patched to whatever comes next
+struct rxFrag {
+  int start;
+  int **outs;
+  int nouts;
+  char *exact; // the fragment matches exactly this string (or NULL)
+  int exactlen;
+  char *req;   // longest literal any match of the fragment contains
+  int reqlen;
+};
+
+struct rxParser {
+  const char *p;
+  struct regex *re;
+  const char *err;
+};
+
+int rxNewState(struct regex *re, int type, int out, int out1) {
+  struct rxState *st = &re->states[re->nstates];
+  st->type = type;
+  st->out = out;
+  st->out1 = out1;
+  st->cls = -1;
+  return re->nstates++;
+}
+
+int rxNewClass(struct regex *re) {
+  re->classes = realloc(re->classes, sizeof(*re->classes) * (re->nclasses + 1));
+  memset(re->classes[re->nclasses], 0, 32);
+  return re->nclasses++;
+}
+
+void rxClassAdd(unsigned char *cls, int from, int to) {
+  for (int c = from; c <= to; c++) {
+    cls[c >> 3] |= 1 << (c & 7);
+  }
+}
+
+// Fill `cls` for \d \w \s (negated for upper case); 0 if not a class escape
+int rxClassEscape(unsigned char *cls, char e) {
+  unsigned char tmp[32] = {0};
+  switch (e | 0x20) {
+    case 'd':
+      rxClassAdd(tmp, '0', '9');
+      break;
+    case 'w':
+      rxClassAdd(tmp, '0', '9');
+      rxClassAdd(tmp, 'a', 'z');
+      rxClassAdd(tmp, 'A', 'Z');
+      rxClassAdd(tmp, '_', '_');
+      break;
+    case 's':
+      rxClassAdd(tmp, ' ', ' ');
+      rxClassAdd(tmp, '\t', '\r');
+      break;
+    default:
+      return 0;
+  }
+  for (int i = 0; i < 32; i++) {
+    cls[i] |= (e >= 'a') ? tmp[i] : (unsigned char)~tmp[i];
+  }
+  return 1;
+}
+
+// Byte for a simple escape like \t or \. (anything else stands for itself)
+char rxEscapeByte(char e) {
+  switch (e) {
+    case 'n':
+      return '\n';
+    case 't':
+      return '\t';
+    case 'r':
+      return '\r';
+    default:
+      return e;
+  }
+}
+
+void rxFragFree(struct rxFrag *f) {
+  free(f->outs);
+  free(f->exact);
+  free(f->req);
+}
+
+void rxFragAddOut(struct rxFrag *f, int *out) {
+  f->outs = realloc(f->outs, sizeof(*f->outs) * (f->nouts + 1));
+  f->outs[f->nouts++] = out;
+}
+
+void rxPatch(struct rxFrag *f, int to) {
+  for (int i = 0; i < f->nouts; i++) {
+    *f->outs[i] = to;
+  }
+  f->nouts = 0;
+}
+
+// Keep `s` as the fragment's required literal if it beats the current one
+void rxFragOfferReq(struct rxFrag *f, const char *s, int len) {
+  if (s == NULL || len <= f->reqlen) {
+    return;
+  }
+  free(f->req);
+  f->req = malloc(len + 1);
+  memcpy(f->req, s, len);
+  f->req[len] = '\0';
+  f->reqlen = len;
+}
+
+// Single-state fragment (byte, assertion or empty)
+struct rxFrag rxFragState(struct regex *re, int type) {
+  struct rxFrag f = {0};
+  f.start = rxNewState(re, type, -1, -1);
+  rxFragAddOut(&f, &re->states[f.start].out);
+  return f;
+}
+
+struct rxFrag rxParseAlt(struct rxParser *ps);
+
+/*
+ * atom := '(' alt ')' | '[' set ']' | '.' | '^' | '$' | '\' byte | byte
+ */
+struct rxFrag rxParseAtom(struct rxParser *ps) {
+  struct regex *re = ps->re;
+  struct rxFrag f = {0};
+  char c = *ps->p++;
+
+  if (c == '(') {
+    f = rxParseAlt(ps);
+    if (*ps->p != ')') {
+      ps->err = "missing )";
+      return f;
+    }
+    ps->p++;
+    return f;
+  }
+  if (c == '^' || c == '$') {
+    return rxFragState(re, c == '^' ? RX_BOL : RX_EOL);
+  }
+
+  f = rxFragState(re, RX_BYTE);
+  int cls = rxNewClass(re);
+  re->states[f.start].cls = cls;
+  unsigned char *set = re->classes[cls];
+
+  if (c == '.') {
+    rxClassAdd(set, 0, 255);
+  } else if (c == '[') {
+    int negate = (*ps->p == '^');
+    if (negate) {
+      ps->p++;
+    }
+    // A ']' right after '[' or '[^' is literal
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)) {
+      unsigned char lo = *ps->p++;
+      first = 0;
+      if (lo == '\\') {
+        if (!*ps->p) {
+          break;
+        }
+        if (rxClassEscape(set, *ps->p)) {
+          ps->p++;
+          continue;
+        }
+        lo = rxEscapeByte(*ps->p++);
+      }
+      unsigned char hi = lo;
+      if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+        ps->p++;
+        hi = *ps->p++;
+        if (hi == '\\' && *ps->p) {
+          hi = rxEscapeByte(*ps->p++);
+        }
+      }
+      if (lo <= hi) {
+        rxClassAdd(set, lo, hi);
+      }
+    }
+    if (*ps->p != ']') {
+      ps->err = "missing ]";
+      return f;
+    }
+    ps->p++;
+    if (negate) {
+      for (int i = 0; i < 32; i++) {
+        set[i] = ~set[i];
+      }
+    }
+  } else {
+    if (c == '\\') {
+      if (!*ps->p) {
+        ps->err = "trailing \\";
+        return f;
+      }
+      c = *ps->p++;
+      if (rxClassEscape(set, c)) {
+        return f;
+      }
+      c = rxEscapeByte(c);
+    }
+    rxClassAdd(set, (unsigned char)c, (unsigned char)c);
+    f.exact = malloc(2);
+    f.exact[0] = c;
+    f.exact[1] = '\0';
+    f.exactlen = 1;
+    rxFragOfferReq(&f, f.exact, 1);
+  }
+  return f;
+}
+
+/*
+ * repeat := atom ('*' | '+' | '?')*
+ * Only '+' keeps the atom's required literal: '*' and '?' may skip it.
+ */
+struct rxFrag rxParseRepeat(struct rxParser *ps) {
+  struct regex *re = ps->re;
+  struct rxFrag f = rxParseAtom(ps);
+
+  while (!ps->err && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')) {
+    char op = *ps->p++;
+    int s = rxNewState(re, RX_SPLIT, f.start, -1);
+
+    free(f.exact);
+    f.exact = NULL;
+    f.exactlen = 0;
+    if (op != '+') {
+      free(f.req);
+      f.req = NULL;
+      f.reqlen = 0;
+    }
+
+    // a* loops back through the split; a+ enters the atom first; a? may
+    // skip it
+    if (op == '*' || op == '+') {
+      rxPatch(&f, s);
+    }
+    if (op != '+') {
+      f.start = s;
+    }
+    rxFragAddOut(&f, &re->states[s].out1);
+  }
+  return f;
+}
+
+/*
+ * concat := repeat*
+ * Consecutive exact pieces join into a literal run; each run (and each
+ * piece's own required literal) is a candidate for the longest literal
+ * every match must contain.
+ */
+struct rxFrag rxParseConcat(struct rxParser *ps) {
+  struct regex *re = ps->re;
+  struct rxFrag f = rxFragState(re, RX_EMPTY);
+  struct abuf run = ABUF_INIT;
+  int allexact = 1;
+
+  while (!ps->err && *ps->p && *ps->p != '|' && *ps->p != ')') {
+    if (*ps->p == '*' || *ps->p == '+' || *ps->p == '?') {
+      ps->err = "nothing to repeat";
+      break;
+    }
+    struct rxFrag item = rxParseRepeat(ps);
+    rxPatch(&f, item.start);
+    for (int i = 0; i < item.nouts; i++) {
+      rxFragAddOut(&f, item.outs[i]);
+    }
+
+    rxFragOfferReq(&f, item.req, item.reqlen);
+    if (item.exact) {
+      abAppend(&run, item.exact, item.exactlen);
+    } else {
+      rxFragOfferReq(&f, run.b, run.len);
+      run.len = 0;
+      allexact = 0;
+    }
+    rxFragFree(&item);
+  }
+
+  rxFragOfferReq(&f, run.b, run.len);
+  if (allexact && run.len > 0) {
+    f.exact = malloc(run.len + 1);
+    memcpy(f.exact, run.b, run.len);
+    f.exact[run.len] = '\0';
+    f.exactlen = run.len;
+  }
+  abFree(&run);
+  return f;
+}
+
+/*
+ * alt := concat ('|' concat)*
+ * An alternation guarantees no single literal, so it has none.
+ */
+struct rxFrag rxParseAlt(struct rxParser *ps) {
+  struct regex *re = ps->re;
+  struct rxFrag f = rxParseConcat(ps);
+
+  while (!ps->err && *ps->p == '|') {
+    ps->p++;
+    struct rxFrag g = rxParseConcat(ps);
+    f.start = rxNewState(re, RX_SPLIT, f.start, g.start);
+    for (int i = 0; i < g.nouts; i++) {
+      rxFragAddOut(&f, g.outs[i]);
+    }
+    rxFragFree(&g);
+
+    free(f.exact);
+    free(f.req);
+    f.exact = f.req = NULL;
+    f.exactlen = f.reqlen = 0;
+  }
+  return f;
+}
+
+void regexFree(struct regex *re) {
+  if (re) {
+    free(re->states);
+    free(re->classes);
+    free(re->literal);
+    free(re);
+  }
+}
+
+/*
+ * Compile `pattern`. Returns NULL and sets *err on a syntax error.
+ */
+struct regex *regexCompile(const char *pattern, const char **err) {
+  struct regex *re = calloc(1, sizeof(*re));
+  // Every pattern byte adds at most two states, plus empty and match states
+  re->states = malloc(sizeof(*re->states) * (2 * strlen(pattern) + 4));
+
+  struct rxParser ps = {pattern, re, NULL};
+  struct rxFrag f = rxParseAlt(&ps);
+  if (!ps.err && *ps.p) {
+    ps.err = "unmatched )";
+  }
+  if (ps.err) {
+    *err = ps.err;
+    rxFragFree(&f);
+    regexFree(re);
+    return NULL;
+  }
+
+  rxPatch(&f, rxNewState(re, RX_MATCH, -1, -1));
+  re->start = f.start;
+  re->literal = f.req;
+  re->litlen = f.reqlen;
+  f.req = NULL;
+  rxFragFree(&f);
+  return re;
+}
+
+/*
+ * Lazy DFA over a compiled regex. Each DFA state is a sorted set of NFA
+ * states; transitions are computed on first use and cached in next[].
+ * Not thread-safe: every thread searching with a regex gets its own.
+ */
+struct rxDState {
+  int *set;
+  int nset;
+  unsigned hash;
+  int match;     // set contains RX_MATCH
+  int eolmatch;  // matches if input ends here (-1 = not computed yet)
+  int next[256]; // -2 = not computed, -1 = dead
+};
+
+struct rxDfa {
+  const struct regex *re;
+  int unanchored;         // a match may start at any position
+  struct rxDState *states;
+  int nstates, cap;
+  int *table;             // open-addressed hash of state indices (-1 empty)
+  int tablesize;
+  int start[2];           // start state not at / at beginning of line
+  int *stack;             // closure scratch, one slot per NFA state
+  unsigned *mark;
+  unsigned markgen;
+  int *buf;
+  int nbuf;
+  unsigned flushes;       // times the cache was emptied
+};
+
+void rxDfaInit(struct rxDfa *d, const struct regex *re, int unanchored) {
+  memset(d, 0, sizeof(*d));
+  d->re = re;
+  d->unanchored = unanchored;
+  d->start[0] = d->start[1] = -2;
+  d->tablesize = 64;
+  d->table = malloc(sizeof(int) * d->tablesize);
+  memset(d->table, -1, sizeof(int) * d->tablesize);
+  // Each state is expanded once and pushes at most two successors
+  d->stack = malloc(sizeof(int) * (2 * re->nstates + 1));
+  d->mark = calloc(re->nstates, sizeof(unsigned));
+  d->buf = malloc(sizeof(int) * re->nstates);
+}
+
+void rxDfaFlush(struct rxDfa *d) {
+  for (int i = 0; i < d->nstates; i++) {
+    free(d->states[i].set);
+  }
+  d->nstates = 0;
+  memset(d->table, -1, sizeof(int) * d->tablesize);
+  d->start[0] = d->start[1] = -2;
+  d->flushes++;
+}
+
+void rxDfaFree(struct rxDfa *d) {
+  rxDfaFlush(d);
+  free(d->states);
+  free(d->table);
+  free(d->stack);
+  free(d->mark);
+  free(d->buf);
+}
+
+/*
+ * Add NFA state `s` and everything reachable from it by epsilon moves to
+ * d->buf. BOL/EOL assertions pass only at the beginning/end of the line;
+ * elsewhere EOL states stay in the set in case the line ends there.
+ */
+void rxClosure(struct rxDfa *d, int s, int atbol, int ateol) {
+  const struct rxState *st = d->re->states;
+  int sp = 0;
+
+  d->stack[sp++] = s;
+  while (sp > 0) {
+    s = d->stack[--sp];
+    if (s < 0 || d->mark[s] == d->markgen) {
+      continue;
+    }
+    d->mark[s] = d->markgen;
+
+    switch (st[s].type) {
+      case RX_SPLIT:
+        d->stack[sp++] = st[s].out1;
+        d->stack[sp++] = st[s].out;
+        break;
+      case RX_EMPTY:
+        d->stack[sp++] = st[s].out;
+        break;
+      case RX_BOL:
+        if (atbol) {
+          d->stack[sp++] = st[s].out;
+        }
+        break;
+      case RX_EOL:
+        if (ateol) {
+          d->stack[sp++] = st[s].out;
+        } else {
+          d->buf[d->nbuf++] = s;
+        }
+        break;
+      default:
+        d->buf[d->nbuf++] = s;
+        break;
+    }
+  }
+}
+
+int intCmp(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Find or create the DFA state for the set collected in d->buf.
+ * Returns -1 for the empty (dead) set. When the cache is full it is
+ * flushed and rebuilt on demand, so memory stays bounded.
+ */
+int rxDfaIntern(struct rxDfa *d) {
+  if (d->nbuf == 0) {
+    return -1;
+  }
+  qsort(d->buf, d->nbuf, sizeof(int), intCmp);
+
+  unsigned h = 2166136261u;
+  for (int i = 0; i < d->nbuf; i++) {
+    h = (h ^ (unsigned)d->buf[i]) * 16777619u;
+  }
+
+  int mask = d->tablesize - 1;
+  for (int i = h & mask; d->table[i] != -1; i = (i + 1) & mask) {
+    struct rxDState *ds = &d->states[d->table[i]];
+    if (ds->hash == h && ds->nset == d->nbuf &&
+        memcmp(ds->set, d->buf, sizeof(int) * d->nbuf) == 0) {
+      return d->table[i];
+    }
+  }
+
+  if (d->nstates == NEXTE_RX_DFA_STATES) {
+    rxDfaFlush(d);
+  }
+  if (d->nstates == d->cap) {
+    d->cap = d->cap ? d->cap * 2 : 16;
+    d->states = realloc(d->states, sizeof(*d->states) * d->cap);
+  }
+  // Keep the hash table at most half full
+  if (2 * (d->nstates + 1) > d->tablesize) {
+    d->tablesize *= 2;
+    d->table = realloc(d->table, sizeof(int) * d->tablesize);
+    memset(d->table, -1, sizeof(int) * d->tablesize);
+    mask = d->tablesize - 1;
+    for (int k = 0; k < d->nstates; k++) {
+      int i = d->states[k].hash & mask;
+      while (d->table[i] != -1) {
+        i = (i + 1) & mask;
+      }
+      d->table[i] = k;
+    }
+  }
+
+  int idx = d->nstates++;
+  struct rxDState *ds = &d->states[idx];
+  ds->set = malloc(sizeof(int) * d->nbuf);
+  memcpy(ds->set, d->buf, sizeof(int) * d->nbuf);
+  ds->nset = d->nbuf;
+  ds->hash = h;
+  ds->match = 0;
+  ds->eolmatch = -1;
+  for (int i = 0; i < d->nbuf; i++) {
+    if (d->re->states[d->buf[i]].type == RX_MATCH) {
+      ds->match = 1;
+    }
+  }
+  for (int c = 0; c < 256; c++) {
+    ds->next[c] = -2;
+  }
+
+  int i = h & mask;
+  while (d->table[i] != -1) {
+    i = (i + 1) & mask;
+  }
+  d->table[i] = idx;
+  return idx;
+}
+
+int rxDfaStart(struct rxDfa *d, int atbol) {
+  if (d->start[atbol] == -2) {
+    d->nbuf = 0;
+    d->markgen++;
+    rxClosure(d, d->re->start, atbol, 0);
+    d->start[atbol] = rxDfaIntern(d);
+  }
+  return d->start[atbol];
+}
+
+/*
+ * Transition from DFA state `cur` on byte `c`, building it on first use.
+ */
+int rxDfaNext(struct rxDfa *d, int cur, unsigned char c) {
+  int next = d->states[cur].next[c];
+  if (next != -2) {
+    return next;
+  }
+
+  const struct rxState *st = d->re->states;
+  struct rxDState *ds = &d->states[cur];
+
+  d->nbuf = 0;
+  d->markgen++;
+  for (int i = 0; i < ds->nset; i++) {
+    const struct rxState *s = &st[ds->set[i]];
+    if (s->type == RX_BYTE &&
+        (d->re->classes[s->cls][c >> 3] & (1 << (c & 7)))) {
+      rxClosure(d, s->out, 0, 0);
+    }
+  }
+  if (d->unanchored) {
+    rxClosure(d, d->re->start, 0, 0);
+  }
+
+  unsigned flushes = d->flushes;
+  next = rxDfaIntern(d);
+  // After a flush `cur` is gone; the new state just isn't linked from it
+  if (d->flushes == flushes) {
+    d->states[cur].next[c] = next;
+  }
+  return next;
+}
+
+/*
+ * Would the input match if it ended in DFA state `cur`? ($ assertions
+ * pass at the end of the line.)
+ */
+int rxDfaEolMatch(struct rxDfa *d, int cur) {
+  struct rxDState *ds = &d->states[cur];
+  if (ds->eolmatch != -1) {
+    return ds->eolmatch;
+  }
+
+  const struct rxState *st = d->re->states;
+  int match = ds->match;
+
+  d->nbuf = 0;
+  d->markgen++;
+  for (int i = 0; i < ds->nset; i++) {
+    if (st[ds->set[i]].type == RX_EOL) {
+      rxClosure(d, ds->set[i], 0, 1);
+    }
+  }
+  for (int k = 0; k < d->nbuf; k++) {
+    if (st[d->buf[k]].type == RX_MATCH) {
+      match = 1;
+    }
+  }
+  ds->eolmatch = match;
+  return match;
+}
+
+/*
+ * Per-thread matcher: a compiled regex plus the two DFAs searching needs.
+ * The unanchored DFA finds where the earliest match ends; the anchored one
+ * then finds the leftmost start and longest end.
+ */
+struct rxMatcher {
+  const struct regex *re;
+  struct rxDfa search;
+  struct rxDfa anchored;
+};
+
+void rxMatcherInit(struct rxMatcher *m, const struct regex *re) {
+  m->re = re;
+  rxDfaInit(&m->search, re, 1);
+  rxDfaInit(&m->anchored, re, 0);
+}
+
+void rxMatcherFree(struct rxMatcher *m) {
+  rxDfaFree(&m->search);
+  rxDfaFree(&m->anchored);
+}
+
+// End of the earliest-ending match starting at or after `from`, or -1
+int rxEarliestEnd(struct rxDfa *d, const char *s, int n, int from) {
+  int cur = rxDfaStart(d, from == 0);
+  if (cur == -1) {
+    return -1;
+  }
+  if (d->states[cur].match) {
+    return from;
+  }
+  for (int i = from; i < n; i++) {
+    cur = rxDfaNext(d, cur, s[i]);
+    if (cur == -1) {
+      return -1;
+    }
+    if (d->states[cur].match) {
+      return i + 1;
+    }
+  }
+  return rxDfaEolMatch(d, cur) ? n : -1;
+}
+
+// End of the longest match starting exactly at `at`, or -1
+int rxLongestAt(struct rxDfa *d, const char *s, int n, int at) {
+  int cur = rxDfaStart(d, at == 0);
+  if (cur == -1) {
+    return -1;
+  }
+  int last = d->states[cur].match ? at : -1;
+  for (int i = at; i < n; i++) {
+    cur = rxDfaNext(d, cur, s[i]);
+    if (cur == -1) {
+      return last;
+    }
+    if (d->states[cur].match) {
+      last = i + 1;
+    }
+  }
+  return rxDfaEolMatch(d, cur) ? n : last;
+}
+
+/*
+ * Find the leftmost(-longest) match in s[from..n).
+ * Rows without the required literal are rejected with findSubstring()
+ * before any DFA work, which is what keeps regex search near substring
+ * speed. Returns 1 and the match bounds, or 0.
+ */
+int regexSearch(struct rxMatcher *m, const char *s, int n, int from,
+                int *mstart, int *mend) {
+  const struct regex *re = m->re;
+
+  if (from > n) {
+    return 0;
+  }
+  if (re->literal &&
+      !findSubstring(s + from, n - from, re->literal, re->litlen)) {
+    return 0;
+  }
+
+  int end = rxEarliestEnd(&m->search, s, n, from);
+  if (end == -1) {
+    return 0;
+  }
+  // The leftmost match can't start after the earliest one ends
+  for (int at = from; at <= end; at++) {
+    int e = rxLongestAt(&m->anchored, s, n, at);
+    if (e != -1) {
+      *mstart = at;
+      *mend = e;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Compiled patterns for the UI thread, most recently used first, so typing
+ * and stepping through an incremental search reuses the DFA built so far.
+ */
+struct regexCacheEntry {
+  char *pattern;
+  struct regex *re;
+  struct rxMatcher m;
+};
+
+struct regexCacheEntry regexCache[NEXTE_RX_CACHE];
+int regexCacheLen;
+
+/*
+ * Matcher for `pattern` from the cache, compiling it on a miss (evicting
+ * the least recently used entry). Returns NULL for an invalid pattern.
+ */
+struct rxMatcher *regexCacheGet(const char *pattern, const char **err) {
+  int i;
+  for (i = 0; i < regexCacheLen; i++) {
+    if (strcmp(regexCache[i].pattern, pattern) == 0) {
+      break;
+    }
+  }
+
+  if (i == regexCacheLen) {
+    struct regex *re = regexCompile(pattern, err);
+    if (re == NULL) {
+      return NULL;
+    }
+    if (regexCacheLen == NEXTE_RX_CACHE) {
+      i = --regexCacheLen;
+      free(regexCache[i].pattern);
+      rxMatcherFree(&regexCache[i].m);
+      regexFree(regexCache[i].re);
+    } else {
+      i = regexCacheLen;
+    }
+    regexCache[i].pattern = strdup(pattern);
+    regexCache[i].re = re;
+    rxMatcherInit(&regexCache[i].m, re);
+    regexCacheLen++;
+  }
+
+  // Move to the front
+  struct regexCacheEntry hit = regexCache[i];
+  memmove(&regexCache[1], &regexCache[0], sizeof(hit) * i);
+  regexCache[0] = hit;
+  // The matcher's DFAs point at the regex, not the entry, so moving is fine
+  return &regexCache[0].m;
+}
+
+/*** find ***/
+
+/*
+ * Find the first occurrence of needle[0..m) in hay[0..n).
+ * With SSE2, 16 candidate positions are tested at once: a position survives
+ * only if both the needle's first and last byte match there, which rejects
+ * almost everything in two compares; survivors are confirmed with memcmp().
+ * The tail (and non-SSE2 builds) fall back to memmem().
+ */
+const char *findSubstring(const char *hay, size_t n, const char *needle,
+                          size_t m) {
+  if (m == 0) {
+    return hay;
+  }
+  if (m > n) {
+    return NULL;
+  }
+
+  size_t i = 0;
+#ifdef __SSE2__
+  if (m > 1) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+
+    // Both 16-byte loads must stay inside hay
+    for (; i + m - 1 + 16 <= n; i += 16) {
+      __m128i bf = _mm_loadu_si128((const __m128i *)(hay + i));
+      __m128i bl = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+      unsigned mask = _mm_movemask_epi8(
+          _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+
+      while (mask) {
+        int bit = __builtin_ctz(mask);
+        if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) {
+          return hay + i + bit;
+        }
+        mask &= mask - 1;
+      }
+    }
+  }
+#endif
+
+  return memmem(hay + i, n - i, needle, m);
+}
+
+/*
+ * Next match in `row` starting at or after byte `from`, for the plain query
+ * or, when `rx` is set, the regex. Returns 1 and the bounds, or 0.
+ */
+int findNext(erow *row, const char *query, size_t qlen, struct rxMatcher *rx,
+             int from, int *mstart, int *mend) {
+  const char *chars = editorRowChars(row);
+  if (rx) {
+    return regexSearch(rx, chars, row->size, from, mstart, mend);
+  }
+  if (from > row->size) {
+    return 0;
+  }
+  const char *match =
+      findSubstring(chars + from, row->size - from, query, qlen);
+  if (!match) {
+    return 0;
+  }
+  *mstart = match - chars;
+  *mend = *mstart + qlen;
+  return 1;
+}
+
+/*
+ * Look for the query in one row.
+ * Forward: first match starting after column `col` (-1 = anywhere).
+ * Backward: last match starting before `col` (INT_MAX = anywhere).
+ * Returns the match column, or -1.
+ */
+int editorFindInRow(erow *row, const char *query, size_t qlen,
+                    struct rxMatcher *rx, int col, int direction) {
+  int found = -1;
+  int from = direction == 1 ? col + 1 : 0;
+  int ms, me;
+
+  while (findNext(row, query, qlen, rx, from, &ms, &me)) {
+    if (direction == 1) {
+      return ms;
+    }
+    if (ms >= col) {
+      break;
+    }
+    // Backward: remember it and keep looking for a later one before col
+    found = ms;
+    from = ms + 1;
+  }
+  return found;
+}
+
+/*
+ * Run the pending scan until it finds a match, wraps around to where it
+ * started, or uses up its time slice (then S.scanning stays set and the
+ * idle loop calls back in). Replay runs scans to completion so the result
+ * doesn't depend on machine speed.
+ */
+void editorFindStep() {
+  struct timespec start, now;
+  size_t qlen = strlen(S.query);
+  int checked = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  S.scanning = 0;
+
+  while (S.remaining > 0 && E.numrows > 0) {
+    int col = editorFindInRow(&E.row[S.row], S.query, qlen, S.rx, S.col,
+                              S.direction);
+    if (col != -1) {
+      S.match_row = S.row;
+      S.match_col = col;
+      E.cy = S.row;
+      E.cx = col;
+      // Scroll so the match lands on the top line (editorScroll() pulls
+      // rowoff back to the cursor)
+      E.rowoff = E.numrows;
+      return;
+    }
+
+    S.remaining--;
+    S.row += S.direction;
+    if (S.row == -1) {
+      S.row = E.numrows - 1;
+    } else if (S.row == E.numrows) {
+      S.row = 0;
+    }
+    S.col = S.direction == 1 ? -1 : INT_MAX;
+
+    // Reading the clock costs more than a short row: check every 256 rows
+    if (!R.active && ++checked % 256 == 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if ((now.tv_sec - start.tv_sec) * 1000000000LL +
+              (now.tv_nsec - start.tv_nsec) >
+          NEXTE_SEARCH_SLICE_NS) {
+        S.scanning = 1;
+        return;
+      }
+    }
+  }
+}
+
+/*
+ * editorPrompt() callback: search as the query is typed.
+ * Arrows step to the next/previous match, Enter keeps the cursor on the
+ * match, ESC puts it back where the search started.
+ */
+void editorFindCallback(char *query, int key) {
+  S.query = query;
+
+  if (key == CTRL_KEY('r')) {
+    S.regex = !S.regex;
+    snprintf(S.prompt, sizeof(S.prompt), "%s: %%s (Use ESC/Arrows/Enter)",
+             S.regex ? "Regex search" : "Search");
+  }
+
+  if (key == '\r' || key == '\x1b') {
+    S.scanning = 0;
+    if (key == '\x1b') {
+      E.cx = S.saved_cx;
+      E.cy = S.saved_cy;
+      E.rowoff = S.saved_rowoff;
+      E.coloff = S.saved_coloff;
+    }
+    return;
+  }
+
+  if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    S.direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    S.direction = -1;
+  } else {
+    // The query changed: search again from where Ctrl-F was pressed
+    S.direction = 1;
+    S.match_row = -1;
+    E.cx = S.saved_cx;
+    E.cy = S.saved_cy;
+    E.rowoff = S.saved_rowoff;
+    E.coloff = S.saved_coloff;
+  }
+
+  if (query[0] == '\0' || E.numrows == 0) {
+    S.scanning = 0;
+    return;
+  }
+
+  // A half-typed regex (say "ab(") just doesn't match anything yet
+  if (S.regex) {
+    const char *err;
+    S.rx = regexCacheGet(query, &err);
+    if (S.rx == NULL) {
+      S.scanning = 0;
+      return;
+    }
+  } else {
+    S.rx = NULL;
+  }
+
+  // Start at the current match, or (new query) just before the cursor so a
+  // match right under it counts; +1 row lets the scan wrap back to its start
+  if (S.match_row != -1) {
+    S.row = S.match_row;
+    S.col = S.match_col;
+  } else {
+    S.row = S.saved_cy < E.numrows ? S.saved_cy : 0;
+    S.col = S.saved_cy < E.numrows ? S.saved_cx - 1 : -1;
+  }
+  S.remaining = E.numrows + 1;
+  editorFindStep();
+}
+
+/*
+ * Incremental search (Ctrl-F). Ctrl-R in the prompt switches between plain
+ * text and regex; the mode sticks for the next search.
+ */
+void editorFind() {
+  S.saved_cx = E.cx;
+  S.saved_cy = E.cy;
+  S.saved_rowoff = E.rowoff;
+  S.saved_coloff = E.coloff;
+  S.match_row = -1;
+  S.direction = 1;
+
+  snprintf(S.prompt, sizeof(S.prompt), "%s: %%s (Use ESC/Arrows/Enter)",
+           S.regex ? "Regex search" : "Search");
+  char *query = editorPrompt(S.prompt, editorFindCallback);
+
+  S.query = NULL;
+  S.rx = NULL;
+  free(query);
+}
+
+/*** find all ***/
+
+/*
+ * Hand a worker's batch of matches to the UI thread.
+ * Only the first batch after the UI drained the queue wakes it up; the
+ * rest ride along with that wakeup.
+ */
+void findAllPublish(struct findMatch *batch, int n) {
+  pthread_mutex_lock(&FA.lock);
+  int wake = (FA.queuelen == 0);
+  if (FA.queuelen + n > FA.queuecap) {
+    FA.queuecap = (FA.queuelen + n) * 2;
+    FA.queue = realloc(FA.queue, sizeof(*FA.queue) * FA.queuecap);
+  }
+  memcpy(&FA.queue[FA.queuelen], batch, sizeof(*batch) * n);
+  FA.queuelen += n;
+  FA.total += n;
+  pthread_mutex_unlock(&FA.lock);
+
+  if (wake) {
+    editorWake();
+  }
+}
+
+/*
+ * Worker: claim the next slice of rows, scan it with findNext(), and
+ * publish matches every NEXTE_FINDALL_BATCH or at the end of each slice.
+ */
+void *findAllWorker(void *arg) {
+  struct findMatch batch[NEXTE_FINDALL_BATCH];
+  int n = 0;
+  struct rxMatcher matcher, *rx = NULL;
+  (void)arg;
+
+  // The compiled regex is shared read-only; the lazy DFA is per worker
+  if (FA.re) {
+    rxMatcherInit(&matcher, FA.re);
+    rx = &matcher;
+  }
+
+  while (!atomic_load_explicit(&FA.cancel, memory_order_relaxed)) {
+    int start = atomic_fetch_add(&FA.next_chunk, NEXTE_FINDALL_CHUNK);
+    if (start >= FA.numrows) {
+      break;
+    }
+    int end = start + NEXTE_FINDALL_CHUNK;
+    if (end > FA.numrows) {
+      end = FA.numrows;
+    }
+
+    for (int i = start; i < end; i++) {
+      int from = 0, ms, me;
+
+      if (atomic_load_explicit(&FA.cancel, memory_order_relaxed)) {
+        break;
+      }
+      // Non-overlapping occurrences, left to right (empty regex matches
+      // step one byte so they can't loop)
+      while (findNext(&FA.rows[i], FA.query, FA.qlen, rx, from, &ms, &me)) {
+        batch[n].row = i;
+        batch[n].col = ms;
+        if (++n == NEXTE_FINDALL_BATCH) {
+          findAllPublish(batch, n);
+          n = 0;
+        }
+        from = me > ms ? me : ms + 1;
+      }
+    }
+    if (n > 0) {
+      findAllPublish(batch, n);
+      n = 0;
+    }
+  }
+
+  if (rx) {
+    rxMatcherFree(rx);
+  }
+
+  // The last worker out wakes the UI to collect the final result
+  if (atomic_fetch_sub(&FA.active, 1) == 1) {
+    editorWake();
+  }
+  return NULL;
+}
+
+/*
+ * Move queued matches into FA.matches (UI thread only).
+ */
+void findAllDrain() {
+  pthread_mutex_lock(&FA.lock);
+  int n = FA.queuelen;
+  if (FA.nmatches + n > NEXTE_FINDALL_MAX_STORED) {
+    n = NEXTE_FINDALL_MAX_STORED - FA.nmatches;
+  }
+  if (FA.nmatches + n > FA.capmatches) {
+    FA.capmatches = (FA.nmatches + n) * 2;
+    FA.matches = realloc(FA.matches, sizeof(*FA.matches) * FA.capmatches);
+  }
+  memcpy(&FA.matches[FA.nmatches], FA.queue, sizeof(*FA.queue) * n);
+  FA.nmatches += n;
+  FA.queuelen = 0;
+  pthread_mutex_unlock(&FA.lock);
+}
+
+int findMatchCmp(const void *a, const void *b) {
+  const struct findMatch *x = a, *y = b;
+  if (x->row != y->row) {
+    return x->row < y->row ? -1 : 1;
+  }
+  return (x->col > y->col) - (x->col < y->col);
+}
+
+/*
+ * Jump to match `i` of the finished result, scrolling it to the top line.
+ */
+void editorFindAllGoto(int i) {
+  FA.current = i;
+  E.cy = FA.matches[i].row;
+  E.cx = FA.matches[i].col;
+  // Results can predate edits made since: stay inside the buffer
+  if (E.cy > E.numrows) {
+    E.cy = E.numrows;
+  }
+  if (E.cx > (E.cy < E.numrows ? E.row[E.cy].size : 0)) {
+    E.cx = E.cy < E.numrows ? E.row[E.cy].size : 0;
+  }
+  E.rowoff = E.numrows;
+}
+
+/*
+ * Join the workers and settle the result (UI thread only).
+ * cancel = 1 stops them early (keypress, or rows about to change);
+ * cancel = 0 waits for a full result. Completed searches are sorted and
+ * the cursor moves to the first match at or after it.
+ */
+void editorFindAllStop(int cancel) {
+  if (!FA.running) {
+    return;
+  }
+  if (cancel) {
+    atomic_store(&FA.cancel, 1);
+  }
+  for (int i = 0; i < FA.nthreads; i++) {
+    pthread_join(FA.threads[i], NULL);
+  }
+  FA.running = 0;
+  findAllDrain();
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double ms = (now.tv_sec - FA.start.tv_sec) * 1e3 +
+              (now.tv_nsec - FA.start.tv_nsec) / 1e6;
+
+  if (atomic_load(&FA.cancel)) {
+    FA.nmatches = 0;
+    editorSetStatusMessage("Find all cancelled after %lld matches", FA.total);
+    return;
+  }
+
+  qsort(FA.matches, FA.nmatches, sizeof(*FA.matches), findMatchCmp);
+  editorSetStatusMessage("%lld matches for \"%s\" in %.1f ms "
+                         "(Ctrl-N/Ctrl-P to step)",
+                         FA.total, FA.query, ms);
+
+  struct findMatch here = {E.cy, E.cx};
+  for (int i = 0; i < FA.nmatches; i++) {
+    if (findMatchCmp(&FA.matches[i], &here) >= 0) {
+      editorFindAllGoto(i);
+      return;
+    }
+  }
+  if (FA.nmatches > 0) {
+    editorFindAllGoto(0);
+  }
+}
+
+/*
+ * Idle-loop hook: pull in streamed matches and keep the live count in the
+ * message bar current. Returns 1 if the screen needs a redraw.
+ */
+int editorFindAllPoll() {
+  if (!FA.running) {
+    return 0;
+  }
+  if (atomic_load(&FA.active) == 0) {
+    editorFindAllStop(0);
+    return 1;
+  }
+
+  findAllDrain();
+  long long total;
+  pthread_mutex_lock(&FA.lock);
+  total = FA.total;
+  pthread_mutex_unlock(&FA.lock);
+  editorSetStatusMessage("Find all: %lld matches so far (any key cancels)",
+                         total);
+  return 1;
+}
+
+/*
+ * Step through the last find-all result (Ctrl-N / Ctrl-P), wrapping.
+ */
+void editorFindAllNext(int direction) {
+  if (FA.running || FA.nmatches == 0) {
+    editorSetStatusMessage("No find-all result (Ctrl-G)");
+    return;
+  }
+  int i = (FA.current + direction + FA.nmatches) % FA.nmatches;
+  editorFindAllGoto(i);
+  editorSetStatusMessage("Match %d of %d", i + 1, FA.nmatches);
+}
+
+// editorPrompt() callback for Ctrl-G: Ctrl-R toggles regex mode
+void editorFindAllCallback(char *query, int key) {
+  (void)query;
+  if (key == CTRL_KEY('r')) {
+    FA.regex = !FA.regex;
+    snprintf(FA.prompt, sizeof(FA.prompt), "Find all%s: %%s (ESC to cancel)",
+             FA.regex ? " (regex)" : "");
+  }
+}
+
+/*
+ * Find every occurrence of a query in the buffer (Ctrl-G) using one worker
+ * per CPU. Returns right away; the idle loop streams in the count.
+ */
+void editorFindAll() {
+  snprintf(FA.prompt, sizeof(FA.prompt), "Find all%s: %%s (ESC to cancel)",
+           FA.regex ? " (regex)" : "");
+  char *query = editorPrompt(FA.prompt, editorFindAllCallback);
+  if (query == NULL) {
+    return;
+  }
+
+  // Compiled separately from the prompt's cache: workers keep using it
+  regexFree(FA.re);
+  FA.re = NULL;
+  if (FA.regex) {
+    const char *err;
+    FA.re = regexCompile(query, &err);
+    if (FA.re == NULL) {
+      editorSetStatusMessage("Bad regex: %s", err);
+      free(query);
+      return;
+    }
+  }
+
+  free(FA.query);
+  FA.query = query;
+  FA.qlen = strlen(query);
+  FA.rows = E.row;
+  FA.numrows = E.numrows;
+  FA.nmatches = 0;
+  FA.current = 0;
+  FA.queuelen = 0;
+  FA.total = 0;
+  atomic_store(&FA.next_chunk, 0);
+  atomic_store(&FA.cancel, 0);
+  clock_gettime(CLOCK_MONOTONIC, &FA.start);
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = ncpu < 1 ? 1 : ncpu;
+  if (nthreads > NEXTE_FINDALL_MAX_THREADS) {
+    nthreads = NEXTE_FINDALL_MAX_THREADS;
+  }
+
+  // `active` counts workers that still have to finish, set before any run
+  atomic_store(&FA.active, nthreads);
+  FA.nthreads = 0;
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&FA.threads[i], NULL, findAllWorker, NULL) != 0) {
+      break;
+    }
+    FA.nthreads++;
+  }
+  // Workers that failed to start will never check out
+  atomic_fetch_sub(&FA.active, nthreads - FA.nthreads);
+
+  if (FA.nthreads == 0) {
+    editorSetStatusMessage("Find all: can't start worker threads");
+    return;
+  }
+  FA.running = 1;
+  editorSetStatusMessage("Find all: searching...");
+}
+
+/*** latency ***/
+
+/*
+ * Map a latency in ns to its histogram bucket.
+ * Values below LAT_SUB_COUNT get their own bucket. Larger values keep their
+ * top LAT_SUB_BITS - 1 significant bits: `shift` counts the dropped low bits
+ * and selects the power-of-two range, `v >> shift` the position within it.
+ */
+int latencyBucket(uint64_t v) {
+  if (v < LAT_SUB_COUNT) {
+    return (int)v;
+  }
+  int msb = 63 - __builtin_clzll(v);
+  int shift = msb - (LAT_SUB_BITS - 1);
+  return LAT_SUB_COUNT + (shift - 1) * LAT_HALF_COUNT + (int)(v >> shift) -
+         LAT_HALF_COUNT;
+}
+
+/*
+ * Smallest and largest ns value that map to bucket `idx` (inverse of
+ * latencyBucket()).
+ */
+void latencyBucketRange(int idx, uint64_t *lo, uint64_t *hi) {
+  if (idx < LAT_SUB_COUNT) {
+    *lo = *hi = idx;
+    return;
+  }
+  int shift = (idx - LAT_SUB_COUNT) / LAT_HALF_COUNT + 1;
+  uint64_t top = (idx - LAT_SUB_COUNT) % LAT_HALF_COUNT + LAT_HALF_COUNT;
+  *lo = top << shift;
+  *hi = *lo + ((uint64_t)1 << shift) - 1;
+}
+
+/*
+ * Value at quantile q (0..1): upper edge of the bucket holding the
+ * ceil(q * samples)-th smallest sample, capped at the exact maximum.
+ */
+uint64_t latencyPercentile(double q) {
+  if (L.samples == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)(q * L.samples + 0.999999);
+  if (rank < 1) {
+    rank = 1;
+  }
+
+  uint64_t seen = 0;
+  for (int i = 0; i < LAT_BUCKETS; i++) {
+    seen += L.counts[i];
+    if (seen >= rank) {
+      uint64_t lo, hi;
+      latencyBucketRange(i, &lo, &hi);
+      return hi < L.max ? hi : L.max;
+    }
+  }
+  return L.max;
+}
+
+/*
+ * Record the latency of the key whose frame was just written.
+ * Called after the write() in editorRefreshScreen(); costs one clock read and
+ * one counter increment per key.
+ */
+void editorLatencyFrameDone(void) {
+  if (!L.pending) {
+    return;
+  }
+  L.pending = 0;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long long ns = (now.tv_sec - L.keystart.tv_sec) * 1000000000LL +
+                 (now.tv_nsec - L.keystart.tv_nsec);
+  if (ns < 0) {
+    ns = 0;
+  }
+
+  L.counts[latencyBucket(ns)]++;
+  L.samples++;
+  if ((uint64_t)ns > L.max) {
+    L.max = ns;
+  }
+
+  if (R.active) {
+    editorReplayFrameDone(ns);
+  }
+}
+
+/*
+ * Write percentiles and the non-empty buckets of the histogram to `fp`.
+ */
+void editorLatencyReport(FILE *fp) {
+  fprintf(fp, "# nexte key-to-frame latency, %llu samples\n",
+          (unsigned long long)L.samples);
+  fprintf(fp, "p50_us %.1f\n", latencyPercentile(0.50) / 1000.0);
+  fprintf(fp, "p99_us %.1f\n", latencyPercentile(0.99) / 1000.0);
+  fprintf(fp, "p999_us %.1f\n", latencyPercentile(0.999) / 1000.0);
+  fprintf(fp, "max_us %.1f\n", L.max / 1000.0);
+}
+
+/*
+ * Dump the histogram to the --latency file, or to
+ * /tmp/nexte-latency.<pid>.txt when SIGUSR1 arrives without one.
+ * Bucket lines are "<low_ns> <high_ns> <count>" for plotting or merging.
+ */
+void editorLatencyDump(void) {
+  char fallback[64];
+  const char *path = L.path;
+
+  L.dump_requested = 0;
+  if (!path) {
+    snprintf(fallback, sizeof(fallback), "/tmp/nexte-latency.%d.txt",
+             (int)getpid());
+    path = fallback;
+  }
+
+  FILE *fp = fopen(path, "w");
+  if (!fp) {
+    editorSetStatusMessage("Can't write latency dump %s: %s", path,
+                           strerror(errno));
+    return;
+  }
+
+  editorLatencyReport(fp);
+  fprintf(fp, "# low_ns high_ns count\n");
+  for (int i = 0; i < LAT_BUCKETS; i++) {
+    if (L.counts[i]) {
+      uint64_t lo, hi;
+      latencyBucketRange(i, &lo, &hi);
+      fprintf(fp, "%llu %llu %u\n", (unsigned long long)lo,
+              (unsigned long long)hi, L.counts[i]);
+    }
+  }
+  fclose(fp);
+}
+
+// atexit() hook so --latency gets a dump however nexte exits
+void editorLatencyAtExit(void) { editorLatencyDump(); }
+
+// SIGUSR1: only flag the request, the dump happens in editorReadKey()
+void handleSigusr1(int sig) {
+  (void)sig;
+  L.dump_requested = 1;
+}
+
+/*
+ * Arm the SIGUSR1 handler and, if a path was given, the exit-time dump.
+ * No SA_RESTART, so a blocked read() returns EINTR and the dump is written
+ * right away instead of after the next keypress.
+ */
+void editorLatencyInit(const char *path) {
+  L.path = path;
+  if (path) {
+    atexit(editorLatencyAtExit);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handleSigusr1;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+}
+
+/*** memory ***/
+
+// Count an allocation of which the owner needs `used` bytes
+void memCountAdd(struct memCount *c, const void *p, size_t used) {
+  if (p == NULL) {
+    return;
+  }
+  c->blocks++;
+  c->used += used;
+  c->alloc += malloc_usable_size((void *)p);
+}
+
+// Count a buffer's row table and everything its rows point to
+void memCountRows(erow *rows, int numrows) {
+  memCountAdd(&M.table, rows, sizeof(erow) * numrows);
+  for (int i = 0; i < numrows; i++) {
+    erow *row = &rows[i];
+    M.text += row->size;
+    if (row->size > NEXTE_ROW_INLINE) {
+      memCountAdd(&M.chars, row->text.heap, row->size + 1);
+    }
+    if (row->ext) {
+      struct rowRender *ext = row->ext;
+      memCountAdd(&M.render, ext, sizeof(*ext) + row->rsize + 1);
+      memCountAdd(&M.cols, ext->rcol, sizeof(*ext->rcol) * (row->rsize + 1));
+      memCountAdd(&M.cols, ext->ckpt, sizeof(*ext->ckpt) * ext->nckpt);
+    }
+    // Only the UI thread frees replaced arrays, so this one stays valid
+    memCountAdd(&M.hl, atomic_load(&row->hl), row->rsize + 1);
+  }
+  M.rows += numrows;
+}
+
+/*
+ * Walk the rows of every buffer and total what they hold. The parked
+ * buffers keep their rows in BL; the current one's are in the globals.
+ */
+void editorMemoryCount(void) {
+  memset(&M.rows, 0, sizeof(M) - offsetof(struct editorMemory, rows));
+  M.buffers = BL.num;
+  for (int i = 0; i < BL.num; i++) {
+    if (i == BL.cur) {
+      memCountRows(E.row, E.numrows);
+      M.undo += U.bytes;
+    } else {
+      struct editorBuffer *b = &BL.bufs[i];
+      memCountRows(b->row, b->numrows);
+      M.undo += b->undo.bytes;
+    }
+  }
+}
+
+// Allocator bookkeeping per block: glibc keeps the chunk size before it
+#define MEM_CHUNK_HEADER sizeof(size_t)
+
+// Everything the rows cost the heap, headers included
+long long memTotal(void) {
+  const struct memCount *c[] = {&M.chars, &M.render, &M.cols, &M.hl,
+                                &M.table};
+  long long total = 0;
+  for (size_t i = 0; i < sizeof(c) / sizeof(c[0]); i++) {
+    total += c[i]->alloc + c[i]->blocks * (long long)MEM_CHUNK_HEADER;
+  }
+  return total;
+}
+
+// Bytes beyond the text itself, per row
+long long memPerRow(void) {
+  return M.rows ? (memTotal() - M.text) / M.rows : 0;
+}
+
+// Byte count for the message bar: 812, 4.1K, 12.3M, 1.2G
+void memFormat(char *buf, size_t len, long long n) {
+  if (n < 1024) {
+    snprintf(buf, len, "%lld", n);
+  } else if (n < 1024 * 1024) {
+    snprintf(buf, len, "%.1fK", n / 1024.0);
+  } else if (n < 1024LL * 1024 * 1024) {
+    snprintf(buf, len, "%.1fM", n / (1024.0 * 1024));
+  } else {
+    snprintf(buf, len, "%.1fG", n / (1024.0 * 1024 * 1024));
+  }
+}
+
+/*
+ * Show what the rows hold (Ctrl-U): the total, the text, the rendered
+ * copies with their column maps, the row tables, the allocator's rounding
+ * and what each row costs beyond its text.
+ */
+void editorMemoryShow(void) {
+  editorMemoryCount();
+
+  long long slack = memTotal() - M.chars.used - M.render.used - M.cols.used -
+                    M.hl.used - M.table.used;
+  char total[16], chars[16], render[16], table[16], waste[16];
+  memFormat(total, sizeof(total), memTotal());
+  memFormat(chars, sizeof(chars), M.text);
+  memFormat(render, sizeof(render),
+            M.render.used + M.cols.used + M.hl.used);
+  memFormat(table, sizeof(table), M.table.used);
+  memFormat(waste, sizeof(waste), slack);
+  editorSetStatusMessage("Row memory %s: text %s render %s table %s slack %s, "
+                         "%lld B/row",
+                         total, chars, render, table, waste, memPerRow());
+}
+
+void memReport(FILE *fp, const char *name, const struct memCount *c) {
+  fprintf(fp, "%s_blocks %lld\n", name, c->blocks);
+  fprintf(fp, "%s_used %lld\n", name, c->used);
+  fprintf(fp, "%s_alloc %lld\n", name, c->alloc);
+}
+
+/*
+ * Write the full accounting to the --stats file as "<key> <value>" lines.
+ * `slack` is what the allocator rounded up plus its chunk headers, so
+ * that the *_used figures and slack add up to `total`.
+ */
+void editorMemoryDump(void) {
+  FILE *fp = fopen(M.path, "w");
+  if (!fp) {
+    return;
+  }
+
+  editorMemoryCount();
+  long long total = memTotal();
+  long long used = M.chars.used + M.render.used + M.cols.used + M.hl.used +
+                   M.table.used;
+  fprintf(fp, "buffers %d\n", M.buffers);
+  fprintf(fp, "rows %lld\n", M.rows);
+  fprintf(fp, "erow_bytes %zu\n", sizeof(erow));
+  fprintf(fp, "text %lld\n", M.text);
+  memReport(fp, "chars", &M.chars);
+  memReport(fp, "render", &M.render);
+  memReport(fp, "cols", &M.cols);
+  memReport(fp, "hl", &M.hl);
+  memReport(fp, "table", &M.table);
+  fprintf(fp, "chunk_header_bytes %zu\n", MEM_CHUNK_HEADER);
+  fprintf(fp, "slack %lld\n", total - used);
+  fprintf(fp, "total %lld\n", total);
+  fprintf(fp, "overhead_per_row %lld\n", memPerRow());
+  fprintf(fp, "undo %lld\n", M.undo);
+  fclose(fp);
+}
+
+// --stats: dump at exit, however nexte exits
+void editorMemoryInit(const char *path) {
+  M.path = path;
+  if (path) {
+    atexit(editorMemoryDump);
+  }
+}
+
+/*** output ***/
+
+/*
+ * editorScroll() for soft wrap: the viewport is a screen line (W.off), and
+ * E.rowoff follows it as the file row at the top. Code that moves E.rowoff
+ * itself (search restoring the view, find-all jumping) still works: the
+ * viewport then restarts at the top of that row.
+ */
+void editorScrollWrapped() {
+  wrapEnsure();
+  E.coloff = 0;
+
+  if (E.rowoff != W.offrow) {
+    W.off = wrapPrefix(E.rowoff < E.numrows ? E.rowoff : E.numrows);
+  }
+
+  int x;
+  long long line = wrapCursorLine(&x);
+  if (line < W.off) {
+    W.off = line;
+  }
+  if (line >= W.off + E.screenrows) {
+    W.off = line - E.screenrows + 1;
+  }
+
+  E.rowoff = W.offrow = wrapLocate(W.off, &W.offseg);
+}
+
+/*
+ * Adjust viewport to keep cursor visible.
+ * Scrolls when cursor would move outside the viewport.
+ */
+void editorScroll() {
+  E.rx = 0;
+
+  if (E.cy < E.numrows) {
+    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+  }
+
+  if (W.enabled) {
+    editorScrollWrapped();
+    return;
+  }
+
+  // Vertical scroll: viewport top follows cursor up
+  if (E.cy < E.rowoff) {
+    E.rowoff = E.cy;
+  }
+  // Vertical scroll: viewport bottom follows cursor down
+  if (E.cy >= E.rowoff + E.screenrows) {
+    E.rowoff = E.cy - E.screenrows + 1;
+  }
+
+  // Horizontal scroll: viewport left follows cursor left
+  if (E.rx < E.coloff) {
+    E.coloff = E.rx;
+  }
+  // Horizontal scroll: viewport right follows cursor right
+  if (E.rx >= E.coloff + E.screencols) {
+    E.coloff = E.rx - E.screencols + 1;
+  }
+}
+
+/*
+ * Cell attributes as the row renderer tracks them: an SGR foreground color
+ * (39 = default) plus reverse video, which marks control characters.
+ */
+#define ATTR_PLAIN 39
+#define ATTR_REVERSE (1 << 8)
+
+/*
+ * Append one SGR sequence taking the terminal from attributes `from` to
+ * `to`, naming only the parts that differ.
+ */
+void abAppendAttr(struct abuf *ab, int from, int to) {
+  // Back to plain: a bare reset is the shortest way there
+  if (to == ATTR_PLAIN) {
+    abAppend(ab, "\x1b[m", 3);
+    return;
+  }
+
+  char buf[16];
+  int len = snprintf(buf, sizeof(buf), "\x1b[");
+  if ((from ^ to) & ATTR_REVERSE) {
+    len += snprintf(buf + len, sizeof(buf) - len, "%s",
+                    (to & ATTR_REVERSE) ? "7" : "27");
+  }
+  if ((from ^ to) & 0xff) {
+    len += snprintf(buf + len, sizeof(buf) - len, "%s%d",
+                    len > 2 ? ";" : "", to & 0xff);
+  }
+  buf[len++] = 'm';
+  abAppend(ab, buf, len);
+}
+
+/*
+ * Draw `len` render bytes with their highlight classes (hl may be NULL).
+ * Text goes out in runs of equal attributes with an SGR sequence only
+ * where they change; spaces join whatever run they're in, since a space
+ * shows no foreground color. One reset at the end of the line puts the
+ * terminal back to plain, so a highlighted screen stays close to the size
+ * of its text. Control characters show as reverse-video '@'..'Z' for bytes
+ * 0-26, or '?' for the others and DEL.
+ */
+void editorDrawRowText(struct abuf *ab, const char *c,
+                       const unsigned char *hl, int len) {
+  int cur = ATTR_PLAIN;
+  int run = 0; // start of the text not appended yet
+
+  for (int j = 0; j < len; j++) {
+    unsigned char ch = c[j];
+    int ctrl = ch < 32 || ch == 127;
+    int attr;
+
+    if (ctrl) {
+      attr = ATTR_REVERSE | ATTR_PLAIN;
+    } else if (ch == ' ') {
+      attr = cur & ~ATTR_REVERSE;
+    } else if ((ch & 0xc0) == 0x80) {
+      // Never split a UTF-8 sequence with an escape sequence
+      attr = cur;
+    } else {
+      attr = hl ? editorSyntaxToColor(hl[j]) : ATTR_PLAIN;
+    }
+
+    if (attr != cur) {
+      if (j > run) {
+        abAppendRef(ab, &c[run], j - run);
+      }
+      run = j;
+      abAppendAttr(ab, cur, attr);
+      cur = attr;
+    }
+    if (ctrl) {
+      char sym = ch <= 26 ? '@' + ch : '?';
+      if (j > run) {
+        abAppendRef(ab, &c[run], j - run);
+      }
+      abAppend(ab, &sym, 1);
+      run = j + 1;
+    }
+  }
+
+  if (len > run) {
+    abAppendRef(ab, &c[run], len - run);
+  }
+  if (cur != ATTR_PLAIN) {
+    abAppend(ab, "\x1b[m", 3);
+  }
+}
+
+/*
+ * Draw screen columns [col, col + E.screencols) of a row. A double-width
+ * character cut by either edge shows as blanks, so everything else stays
+ * in its column.
+ */
+void editorDrawRow(struct abuf *ab, erow *row, int col) {
+  int end = col + E.screencols;
+
+  // A long row is rendered just for these columns
+  if (editorRowCkpt(row)) {
+    erow win;
+    editorRowWindow(row, col, end, &win);
+    editorDrawRow(ab, &win, col);
+    free(win.ext->rcol);
+    abKeep(ab, win.ext);
+    return;
+  }
+
+  int *rcol = editorRowRcol(row);
+  int from = editorRowColToIdx(row, col);
+  int to = editorRowColToIdx(row, end);
+  int rpad = 0;
+
+  if (rcol && to > from && rcol[to] > end) {
+    int last = rcol[to - 1];
+    while (to > from && rcol[to - 1] == last) {
+      to--;
+    }
+    rpad = end - last;
+  }
+  if (from >= to) {
+    return;
+  }
+
+  for (int lpad = (rcol ? rcol[from] : from) - col; lpad > 0;
+       lpad--) {
+    abAppend(ab, " ", 1);
+  }
+  // One load of the row's hl: the highlighter may swap in a new one
+  unsigned char *rowhl = row->hl;
+  char *render = editorRowRender(row);
+  editorDrawRowText(ab, &render[from], rowhl ? &rowhl[from] : NULL,
+                    to - from);
+  while (rpad-- > 0) {
+    abAppend(ab, " ", 1);
+  }
+}
+
+/*
+ * Move the cursor to the start of text line y of the window: a newline
+ * after the line above if that was drawn and the window starts at the left
+ * edge, else an absolute position. The frame starts at home, and so does
+ * the top left window, which is drawn first.
+ */
+void editorDrawRowsNewline(struct abuf *ab, int y, int drawn) {
+  if (y == 0 && E.winy == 0 && E.winx == 0) {
+    return;
+  }
+  if (drawn && y > 0 && E.winx == 0) {
+    abAppend(ab, "\r\n", 2);
+    return;
+  }
+  char buf[24];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.winy + y + 1,
+                     E.winx + 1);
+  abAppend(ab, buf, len);
+}
+
+// Forget what the terminal shows, so the next frame redraws every line
+void editorScreenInvalidate(void) {
+  if (V.lines) {
+    memset(V.lines, 0, sizeof(*V.lines) * V.rows);
+  }
+  V.status = V.message = 0;
+
+  // The other windows' copies of V
+  for (int i = 0; i < WN.num; i++) {
+    struct editorScreen *s = &WN.nodes[i].screen;
+    if (i == WN.cur || !WN.nodes[i].used) {
+      continue;
+    }
+    if (s->lines) {
+      memset(s->lines, 0, sizeof(*s->lines) * s->rows);
+    }
+    s->status = 0;
+  }
+  WN.borders = 0;
+}
+
+/*
+ * Bring the window's text lines to viewport top `top`: when it moved by
+ * less than a screen since the last frame, shift the lines still in view
+ * with a scroll region over the text area, so the status bars stay put.
+ * A scroll region spans the terminal's width, so a window beside another
+ * redraws its lines instead.
+ * \x1b[T;Br = DECSTBM: scroll region from line T to B (cursor goes home)
+ * \x1b[nS   = SU: scroll the region up n lines (\x1b[nT = SD, down)
+ * \x1b[r    = reset the scroll region to the whole screen
+ * Lines scrolled in are blank and marked unknown.
+ */
+void editorScreenScroll(struct abuf *ab, long long top) {
+  if (V.rows != E.screenrows || V.cols != E.screencols) {
+    free(V.lines);
+    V.lines = calloc(E.screenrows > 0 ? E.screenrows : 1, sizeof(*V.lines));
+    V.rows = E.screenrows;
+    V.cols = E.screencols;
+    V.top = top;
+    V.wrapped = W.enabled;
+    V.status = V.message = 0;
+  }
+
+  long long d = top - V.top;
+  int full = E.winx == 0 && E.screencols == E.termcols;
+  if (full && V.wrapped == W.enabled && d != 0 && d > -V.rows &&
+      d < V.rows) {
+    int n = d > 0 ? d : -d;
+    int keep = V.rows - n;
+    char buf[48];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dr\x1b[%d%c\x1b[r",
+                       E.winy + 1, E.winy + V.rows, n, d > 0 ? 'S' : 'T');
+    abAppend(ab, buf, len);
+
+    if (d > 0) {
+      memmove(V.lines, &V.lines[n], sizeof(*V.lines) * keep);
+      memset(&V.lines[keep], 0, sizeof(*V.lines) * n);
+    } else {
+      memmove(&V.lines[n], V.lines, sizeof(*V.lines) * keep);
+      memset(V.lines, 0, sizeof(*V.lines) * n);
+    }
+  }
+  V.top = top;
+  V.wrapped = W.enabled;
+}
+
+/*
+ * Render editor content rows into buffer for display.
+ * Each row displays a tilde (~) as placeholder for text.
+ * At row 1/3 of screen height, displays welcome message centered.
+ * Uses ANSI escape \x1b[K to clear from cursor to line end (erases leftover
+ * content).
+ * A line whose bytes hash the same as what the terminal already shows there
+ * is left out, and the next line drawn positions the cursor itself.
+ * Draws the focused window, or another one swapped in, from the rows of
+ * `buf`, the buffer it shows.
+ */
+void editorDrawRows(struct abuf *ab, const struct editorBuffer *buf) {
+  editorScreenScroll(ab, W.enabled ? W.off : E.rowoff);
+
+  int y;
+  int drawn = 1; // the cursor is at the end of the line above
+  // Soft wrap starts mid-row when the top line is a continuation
+  int segstart = 0;
+  int filerow = E.rowoff;
+  if (W.enabled && W.offseg && filerow < buf->numrows) {
+    segstart = wrapSegStart(&buf->row[filerow], W.offseg);
+  }
+  // Beside another window, the line is cleared first (ECH): erasing to the
+  // end of the line would take the neighbour's text with it
+  int edge = E.winx + E.screencols == E.termcols;
+
+  for (y = 0; y < E.screenrows; y++, filerow++) {
+    struct abufMark line = abMark(ab);
+    editorDrawRowsNewline(ab, y, drawn);
+    struct abufMark text = abMark(ab);
+    if (!edge) {
+      char ech[16];
+      int len = snprintf(ech, sizeof(ech), "\x1b[%dX", E.screencols);
+      abAppend(ab, ech, len);
+    }
+
+    if (filerow >= buf->numrows) {
+      if (buf->numrows == 0 && filerow == E.screenrows / 3) {
+        char welcome[80];
+        int welcomelen = snprintf(welcome, sizeof(welcome),
+                                  "Nexte editor -- version %s", NEXTE_VERSION);
+
+        if (welcomelen > E.screencols) {
+          welcomelen = E.screencols;
+        }
+
+        int padding = (E.screencols - welcomelen) / 2;
+        if (padding) {
+          abAppend(ab, "~", 1);
+          padding--;
+        }
+
+        while (padding--) {
+          abAppend(ab, " ", 1);
+        }
+
+        abAppend(ab, welcome, welcomelen);
+      } else {
+        abAppend(ab, "~", 1);
+      }
+    } else {
+      // Start at the horizontal scroll position (or the segment)
+      erow *row = &buf->row[filerow];
+      editorDrawRow(ab, row, W.enabled ? segstart : E.coloff);
+
+      // Stay on this row while it has segments left
+      if (W.enabled && (segstart = wrapNextSeg(row, segstart)) <=
+                           editorRowCols(row)) {
+        filerow--;
+      } else {
+        segstart = 0;
+      }
+    }
+
+    if (edge) {
+      abAppend(ab, "\x1b[K", 3);
+    }
+
+    uint64_t h = abHashSince(ab, text) | 1;
+    drawn = h != V.lines[y];
+    if (!drawn) {
+      abTruncate(ab, line);
+    }
+    V.lines[y] = h;
+  }
+}
+
+/*
+ * Render the status bar into B.status: inverted colors, filename and line
+ * count on the left, filetype and position right-aligned. Truncates or pads
+ * with spaces to fit terminal width.
+ */
+void editorRenderStatusBar() {
+  int cols = E.screencols;
+  // SGR 7 + text + SGR 0, and the NUL snprintf() leaves
+  if (B.statuscap < cols + 8) {
+    B.statuscap = cols + 8;
+    B.status = realloc(B.status, B.statuscap);
+  }
+
+  // SGR 7: inverted colors for status bar
+  memcpy(B.status, "\x1b[7m", 4);
+  char *bar = B.status + 4;
+
+  char rstatus[80];
+  int len = snprintf(bar, cols + 1, "%s - %d lines %s", B.name, B.numrows,
+                     B.dirty ? "(modified)" : "");
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", B.filetype,
+                      B.cy + 1, B.numrows);
+
+  if (len > cols) {
+    len = cols;
+  }
+
+  // Fill remaining space with spaces, right-align position display
+  if (cols - len >= rlen) {
+    memset(&bar[len], ' ', cols - len - rlen);
+    memcpy(&bar[cols - rlen], rstatus, rlen);
+  } else {
+    memset(&bar[len], ' ', cols - len);
+  }
+
+  // SGR 0: reset all text attributes (bold, underline, etc.)
+  memcpy(&bar[cols], "\x1b[m", 3);
+  B.statuslen = 4 + cols + 3;
+}
+
+/*
+ * Draw the window's status bar on the line below its text, rendering it
+ * again only if what it shows of `buf` has changed, and sending it only if
+ * the terminal doesn't show it already.
+ */
+void editorDrawStatusBar(struct abuf *ab, const struct editorBuffer *buf) {
+  const char *name = buf->filename ? buf->filename : "[No Name]";
+  const char *filetype = buf->syntax ? buf->syntax->filetype : "no ft";
+  int dirty = buf->dirty != 0;
+
+  if (!B.valid || strncmp(B.name, name, sizeof(B.name) - 1) != 0 ||
+      B.filetype != filetype || B.numrows != buf->numrows || B.cy != E.cy ||
+      B.dirty != dirty || B.cols != E.screencols) {
+    snprintf(B.name, sizeof(B.name), "%s", name);
+    B.filetype = filetype;
+    B.numrows = buf->numrows;
+    B.cy = E.cy;
+    B.dirty = dirty;
+    B.cols = E.screencols;
+    B.valid = 1;
+    editorRenderStatusBar();
+    V.status = 0;
+  }
+  if (V.status) {
+    return;
+  }
+
+  char pos[24];
+  int len = snprintf(pos, sizeof(pos), "\x1b[%d;%dH", E.winy + E.screenrows + 1,
+                     E.winx + 1);
+  abAppend(ab, pos, len);
+  abAppend(ab, B.status, B.statuslen);
+  V.status = 1;
+}
+
+/*
+ * Draw the message bar for temporary status messages, unless the terminal
+ * shows the current one already. Expired messages are cleared by
+ * editorStatusMessagePoll(), so whatever is in E.statusmsg is current.
+ * Clears line with \x1b[K before displaying.
+ */
+void editorDrawMessageBar(struct abuf *ab) {
+  if (V.message) {
+    return;
+  }
+
+  char buf[16];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H\x1b[K", E.termrows);
+  abAppend(ab, buf, len);
+  abAppend(ab, E.statusmsg,
+           E.statusmsglen < E.termcols ? E.statusmsglen : E.termcols);
+  V.message = 1;
+}
+
+// Dividers between side by side windows, sent again only after the layout
+// changed or the screen was invalidated
+void editorDrawBorders(struct abuf *ab) {
+  if (WN.borders) {
+    return;
+  }
+  for (int i = 0; i < WN.num; i++) {
+    struct editorWindow *w = &WN.nodes[i];
+    if (!w->used || w->split != SPLIT_COLS) {
+      continue;
+    }
+    int x = w->x + WN.nodes[w->child[0]].cols;
+    for (int y = w->y; y < w->y + w->rows; y++) {
+      char buf[32];
+      int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH\x1b[7m|\x1b[m", y + 1,
+                         x + 1);
+      abAppend(ab, buf, len);
+    }
+  }
+  WN.borders = 1;
+}
+
+/*
+ * Draw every window in layout order: the focused one from the globals,
+ * the others by swapping their state in and back out. A window on the
+ * current buffer reads the same rows as the focused one; one on another
+ * buffer reads that buffer's parked rows.
+ */
+void editorDrawWindows(struct abuf *ab) {
+  struct editorBuffer cur;
+  editorBufferStore(&cur);
+
+  int first = editorWindowFirst(WN.root);
+  int n = first;
+  do {
+    if (n == WN.cur) {
+      editorDrawRows(ab, &cur);
+      editorDrawStatusBar(ab, &cur);
+    } else {
+      struct editorWindow *w = &WN.nodes[n];
+      const struct editorBuffer *buf =
+          w->buf == BL.cur ? &cur : &BL.bufs[w->buf];
+      editorWindowStore(&WN.nodes[WN.cur]);
+      editorWindowLoad(w);
+      editorDrawRows(ab, buf);
+      editorDrawStatusBar(ab, buf);
+      editorWindowStore(w);
+      editorWindowLoad(&WN.nodes[WN.cur]);
+    }
+    n = editorWindowNext(n);
+  } while (n != first);
+
+  editorDrawBorders(ab);
+}
+
+/*
+ * Clear screen and redraw content using ANSI escape sequences.
+ * Uses append buffer to batch all output into a single write() syscall.
+ * Sequence: begin frame -> home cursor -> draw rows -> status bar -> position
+ * cursor -> end frame.
+ * \x1b[?2026h/l = begin/end synchronized update: the terminal holds the
+ *                old frame until the new one is complete, then swaps
+ * \x1b[?25l/h   = hide/show cursor, the fallback without synchronized
+ *                output (keeps the cursor from flickering across the screen)
+ * \x1b[H    = move cursor to home
+ * \x1b[Y;XH = position cursor at rendered position (rx, not cx)
+ * \x1b[m   = SGR 0: reset all text attributes
+ */
+void editorRefreshScreen() {
+  editorScroll();
+
+  // Show the worker where to start, then pick up what it has replaced
+  if (!H.running || H.buf == BL.cur) {
+    atomic_store(&H.view_top, E.rowoff);
+    atomic_store(&H.view_rows, E.screenrows);
+  }
+  editorHighlightStart();
+  editorHighlightReap();
+
+  // Reused from frame to frame, so drawing doesn't allocate once warm
+  static struct abuf ab = ABUF_INIT;
+
+  if (E.syncoutput) {
+    abAppend(&ab, "\x1b[?2026h", 8);
+  } else {
+    abAppend(&ab, "\x1b[?25l", 6);
+  }
+  abAppend(&ab, "\x1b[H", 3);
+
+  editorDrawWindows(&ab);
+  editorDrawMessageBar(&ab);
+
+  char buf[32];
+
+  // Convert viewport-relative coordinates to absolute terminal positions
+  if (W.enabled) {
+    int x;
+    long long line = wrapCursorLine(&x);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.winy + (int)(line - W.off) + 1,
+             E.winx + x + 1);
+  } else {
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.winy + (E.cy - E.rowoff) + 1,
+             E.winx + (E.rx - E.coloff) + 1);
+  }
+
+  abAppend(&ab, buf, strlen(buf));
+  if (E.syncoutput) {
+    abAppend(&ab, "\x1b[?2026l", 8);
+  } else {
+    abAppend(&ab, "\x1b[?25h", 6);
+  }
+
+  abWrite(&ab);
+  abReset(&ab);
+
+  editorLatencyFrameDone();
+}
+
+/*
+ * Set a status message to display in the status bar.
+ * Uses variadic arguments (like printf) for formatted messages.
+ * Message expires after 5 seconds (see editorStatusMessagePoll()).
+ */
+void editorSetStatusMessage(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt); // initialize variadic argument list
+  int len = vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap); // clean up variadic argument list
+
+  // vsnprintf() returns the untruncated length
+  if (len < 0) {
+    len = 0;
+  } else if (len >= (int)sizeof(E.statusmsg)) {
+    len = sizeof(E.statusmsg) - 1;
+  }
+  E.statusmsglen = len;
+  E.statusmsg_expiry = editorNowMs() + NEXTE_STATUS_MSG_MS;
+  V.message = 0;
+}
+
+/*** replay ***/
+
+/*
+ * Load a keystroke script for headless replay.
+ * Scripts are text so they can be attached to bug reports and diffed:
+ *   \e or \x1b  - escape (arrow keys are "\e[A", Page Down is "\e[6~", ...);
+ *                 one not followed by [ or O is the Escape key itself
+ *   \r \n \t \\ - the usual C escapes; Enter is "\r" like a raw terminal sends
+ *   \xHH        - any other byte
+ * Literal newlines are ignored so scripts can be split over lines, and a line
+ * starting with '#' is a comment.
+ */
+void editorReplayLoad(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    die("fopen");
+  }
+
+  struct abuf ab = ABUF_INIT;
+  int c;
+  int bol = 1; // at beginning of line (comments only start there)
 
-/*
- * Append string `s` of length `len` to buffer `ab`.
- * Reallocates buffer to accommodate new bytes, copies data into position.
- * Silently fails (no-op) if realloc returns NULL (out of memory).
- */
-void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
+  while ((c = getc(fp)) != EOF) {
+    if (bol && c == '#') {
+      while ((c = getc(fp)) != EOF && c != '\n')
+        ;
+      continue;
+    }
+    bol = (c == '\n');
+    if (c == '\n' || c == '\r') {
+      continue;
+    }
 
-  if (new == NULL) {
-    return;
+    char byte = c;
+    if (c == '\\') {
+      c = getc(fp);
+      switch (c) {
+        case 'e':
+          byte = '\x1b';
+          break;
+        case 'r':
+          byte = '\r';
+          break;
+        case 'n':
+          byte = '\n';
+          break;
+        case 't':
+          byte = '\t';
+          break;
+        case 'x':
+          {
+            char hex[3] = {0};
+            if (fscanf(fp, "%2[0-9a-fA-F]", hex) != 1) {
+              errno = EINVAL;
+              die("replay script");
+            }
+            byte = (char)strtol(hex, NULL, 16);
+          }
+          break;
+        case EOF:
+          errno = EINVAL;
+          die("replay script");
+          break;
+        default:
+          byte = c;
+          break;
+      }
+    }
+    abAppend(&ab, &byte, 1);
   }
+  fclose(fp);
 
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+  R.script = path;
+  R.keys = ab.b;
+  R.len = ab.len;
+  R.pos = 0;
 }
 
 /*
- * Free dynamically allocated buffer memory.
- * Called after write() to prevent memory leaks.
+ * Set up the virtual terminal that replay frames are drawn into.
  */
-void abFree(struct abuf *ab) { free(ab->b); }
-
-/*** output ***/
+void editorReplayInit(int cols, int rows) {
+  R.cols = cols;
+  R.rows = rows;
+  R.cells = malloc(sizeof(*R.cells) * rows * cols);
+  for (int i = 0; i < rows * cols; i++) {
+    R.cells[i] = ' ';
+  }
+  R.vx = R.vy = 0;
+  R.top = 0;
+  R.bottom = rows - 1;
+  R.wrapnext = 0;
+  R.esc = 0;
+  R.cpneed = 0;
+  R.active = 1;
+}
 
-/*
- * Adjust viewport to keep cursor visible.
- * Scrolls when cursor would move outside the viewport.
- */
-void editorScroll() {
-  E.rx = 0;
+// Clear cells [from, to) of virtual terminal row y
+void vtClear(int y, int from, int to) {
+  if (from < 0) {
+    from = 0;
+  }
+  if (to > R.cols) {
+    to = R.cols;
+  }
+  for (int x = from; x < to; x++) {
+    R.cells[y * R.cols + x] = ' ';
+  }
+}
 
-  if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+// Scroll the scroll region up n lines (down if n < 0), blanking the rest
+void vtScroll(int n) {
+  int height = R.bottom - R.top + 1;
+  int by = n > 0 ? n : -n;
+  if (by > height) {
+    by = height;
   }
+  uint32_t *region = &R.cells[R.top * R.cols];
+  size_t keep = sizeof(*R.cells) * (height - by) * R.cols;
 
-  // Vertical scroll: viewport top follows cursor up
-  if (E.cy < E.rowoff) {
-    E.rowoff = E.cy;
+  if (n > 0) {
+    memmove(region, &region[by * R.cols], keep);
+    for (int y = R.bottom - by + 1; y <= R.bottom; y++) {
+      vtClear(y, 0, R.cols);
+    }
+  } else {
+    memmove(&region[by * R.cols], region, keep);
+    for (int y = R.top; y < R.top + by; y++) {
+      vtClear(y, 0, R.cols);
+    }
   }
-  // Vertical scroll: viewport bottom follows cursor down
-  if (E.cy >= E.rowoff + E.screenrows) {
-    E.rowoff = E.cy - E.screenrows + 1;
+}
+
+// Move down a line, scrolling the region up at its bottom row
+void vtLineFeed(void) {
+  if (R.vy == R.bottom) {
+    vtScroll(1);
+  } else if (R.vy < R.rows - 1) {
+    R.vy++;
   }
+}
 
-  // Horizontal scroll: viewport left follows cursor left
-  if (E.rx < E.coloff) {
-    E.coloff = E.rx;
+/*
+ * Put a printable character at the cursor.
+ * Like a real terminal, writing the last column leaves the cursor there with
+ * a pending wrap that only happens if another printable character follows.
+ * A double-width character takes two cells (wrapping first if only one is
+ * left); combining marks are dropped, since a cell holds one code point.
+ */
+void vtPut(uint32_t cp) {
+  int width = utf8Width(cp);
+  if (width == 0) {
+    return;
   }
-  // Horizontal scroll: viewport right follows cursor right
-  if (E.rx >= E.coloff + E.screencols) {
-    E.coloff = E.rx - E.screencols + 1;
+  if (R.wrapnext || (width == 2 && R.vx == R.cols - 1)) {
+    R.vx = 0;
+    vtLineFeed();
+    R.wrapnext = 0;
+  }
+  R.cells[R.vy * R.cols + R.vx] = cp;
+  if (width == 2) {
+    R.cells[R.vy * R.cols + ++R.vx] = 0;
+  }
+  if (R.vx == R.cols - 1) {
+    R.wrapnext = 1;
+  } else {
+    R.vx++;
   }
 }
 
 /*
- * Render editor content rows into buffer for display.
- * Each row displays a tilde (~) as placeholder for text.
- * At row 1/3 of screen height, displays welcome message centered.
- * Uses ANSI escape \x1b[K to clear from cursor to line end (erases leftover
- * content).
+ * Execute a complete CSI sequence (ESC [ params final).
+ * Only the sequences nexte emits are interpreted; anything else, including
+ * SGR attributes and mode switches, leaves the screen contents unchanged.
  */
-void editorDrawRows(struct abuf *ab) {
-  int y;
-  for (y = 0; y < E.screenrows; y++) {
-    // Map screen row to file row (accounting for vertical scroll)
-    int filerow = y + E.rowoff;
-    if (filerow >= E.numrows) {
-      if (E.numrows == 0 && filerow == E.screenrows / 3) {
-        char welcome[80];
-        int welcomelen = snprintf(welcome, sizeof(welcome),
-                                  "Nexte editor -- version %s", NEXTE_VERSION);
+void vtCsi(char final) {
+  int params[8] = {0};
+  int nparams = 0;
+  int priv = (R.csilen > 0 && R.csi[0] == '?');
 
-        if (welcomelen > E.screencols) {
-          welcomelen = E.screencols;
-        }
-
-        int padding = (E.screencols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-
-        while (padding--) {
-          abAppend(ab, " ", 1);
-        }
+  for (int i = priv; i < R.csilen && nparams < 8; i++) {
+    char ch = R.csi[i];
+    if (ch >= '0' && ch <= '9') {
+      params[nparams] = params[nparams] * 10 + (ch - '0');
+    } else if (ch == ';') {
+      nparams++;
+    }
+  }
+  if (priv) {
+    return;
+  }
 
-        abAppend(ab, welcome, welcomelen);
+  int p0 = params[0], p1 = params[1];
+  switch (final) {
+    case 'H':
+    case 'f':
+      R.vy = (p0 ? p0 : 1) - 1;
+      R.vx = (p1 ? p1 : 1) - 1;
+      break;
+    case 'A':
+      R.vy -= p0 ? p0 : 1;
+      break;
+    case 'B':
+      R.vy += p0 ? p0 : 1;
+      break;
+    case 'C':
+      R.vx += p0 ? p0 : 1;
+      break;
+    case 'D':
+      R.vx -= p0 ? p0 : 1;
+      break;
+    case 'X':
+      // ECH: blank characters from the cursor on, without moving it
+      vtClear(R.vy, R.vx, R.vx + (p0 ? p0 : 1));
+      break;
+    case 'K':
+      if (p0 == 0) {
+        vtClear(R.vy, R.vx, R.cols);
+      } else if (p0 == 1) {
+        vtClear(R.vy, 0, R.vx + 1);
       } else {
-        abAppend(ab, "~", 1);
+        vtClear(R.vy, 0, R.cols);
       }
-    } else {
-      // Clamp rendering to horizontal scroll position
-      int len = E.row[filerow].rsize - E.coloff;
-
-      if (len < 0) {
-        len = 0;
+      break;
+    case 'r':
+      // DECSTBM: set the scroll region and home the cursor
+      R.top = (p0 ? p0 : 1) - 1;
+      R.bottom = (p1 ? p1 : R.rows) - 1;
+      if (R.top >= R.bottom || R.bottom >= R.rows) {
+        R.top = 0;
+        R.bottom = R.rows - 1;
+      }
+      R.vy = R.vx = 0;
+      break;
+    case 'S':
+      vtScroll(p0 ? p0 : 1);
+      break;
+    case 'T':
+      vtScroll(-(p0 ? p0 : 1));
+      break;
+    case 'J':
+      for (int y = 0; y < R.rows; y++) {
+        if (p0 == 2 || (p0 == 0 && y > R.vy) || (p0 == 1 && y < R.vy)) {
+          vtClear(y, 0, R.cols);
+        }
       }
-      if (len > E.screencols) {
-        len = E.screencols;
+      if (p0 == 0) {
+        vtClear(R.vy, R.vx, R.cols);
+      } else if (p0 == 1) {
+        vtClear(R.vy, 0, R.vx + 1);
       }
+      break;
+    default:
+      return;
+  }
 
-      abAppend(ab, &E.row[filerow].render[E.coloff], len);
-    }
-
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+  // Clamp cursor after motion
+  if (R.vy < 0) {
+    R.vy = 0;
+  }
+  if (R.vy >= R.rows) {
+    R.vy = R.rows - 1;
+  }
+  if (R.vx < 0) {
+    R.vx = 0;
   }
+  if (R.vx >= R.cols) {
+    R.vx = R.cols - 1;
+  }
+  R.wrapnext = 0;
 }
 
 /*
- * Draw a status bar at the bottom of the screen with inverted colors.
- * Left side: filename and line count.
- * Right side: current position.
- * Truncates or pads with spaces to fit terminal width.
+ * Collect a UTF-8 sequence a byte at a time and put the character once it
+ * is complete. Malformed input shows as '?'.
  */
-void editorDrawStatusBar(struct abuf *ab) {
-  // SGR 7: inverted colors for status bar
-  abAppend(ab, "\x1b[7m", 4);
-
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines",
-                     E.filename ? E.filename : "[No Name]", E.numrows);
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
+void vtPutByte(unsigned char b) {
+  if ((b & 0xc0) == 0x80) {
+    if (R.cpneed == 0) {
+      vtPut('?');
+      return;
+    }
+    R.cp = (R.cp << 6) | (b & 0x3f);
+    if (--R.cpneed == 0) {
+      vtPut(R.cp);
+    }
+    return;
+  }
 
-  if (len > E.screencols) {
-    len = E.screencols;
+  if (R.cpneed) {
+    vtPut('?');
+  }
+  if (b >= 0xc2 && b <= 0xdf) {
+    R.cp = b & 0x1f;
+    R.cpneed = 1;
+  } else if (b >= 0xe0 && b <= 0xef) {
+    R.cp = b & 0x0f;
+    R.cpneed = 2;
+  } else if (b >= 0xf0 && b <= 0xf4) {
+    R.cp = b & 0x07;
+    R.cpneed = 3;
+  } else {
+    R.cpneed = 0;
+    vtPut('?');
   }
+}
 
-  abAppend(ab, status, len);
+/*
+ * Feed terminal output into the virtual terminal.
+ * Parser states: 0 = ground, 1 = after ESC, 2 = inside a CSI sequence.
+ */
+void editorReplayFeed(const char *s, int len) {
+  for (int i = 0; i < len; i++) {
+    char c = s[i];
 
-  // Fill remaining space with spaces, right-align position display
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    } else {
-      abAppend(ab, " ", 1);
-      len++;
+    if (R.esc == 1) {
+      R.esc = (c == '[') ? 2 : 0;
+      R.csilen = 0;
+      continue;
+    }
+    if (R.esc == 2) {
+      if (c >= 0x40 && c <= 0x7e) {
+        vtCsi(c);
+        R.esc = 0;
+      } else if (R.csilen < (int)sizeof(R.csi)) {
+        R.csi[R.csilen++] = c;
+      }
+      continue;
+    }
+
+    switch (c) {
+      case '\x1b':
+        R.esc = 1;
+        break;
+      case '\r':
+        R.vx = 0;
+        R.wrapnext = 0;
+        break;
+      case '\n':
+        vtLineFeed();
+        break;
+      case '\b':
+        if (R.vx > 0) {
+          R.vx--;
+        }
+        R.wrapnext = 0;
+        break;
+      default:
+        if ((unsigned char)c >= 0x80) {
+          vtPutByte(c);
+        } else if (c >= 0x20 && c != 0x7f) {
+          vtPut(c);
+        }
+        break;
     }
   }
+}
 
-  // SGR 0: reset all text attributes (bold, underline, etc.)
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2); // move to message bar line
+/*
+ * Keep the per-key timing of the frame that just finished.
+ * Called from editorLatencyFrameDone() in replay mode.
+ */
+void editorReplayFrameDone(long long ns) {
+  R.timings = realloc(R.timings, sizeof(*R.timings) * (R.numtimings + 1));
+  R.timings[R.numtimings].key = L.lastkey;
+  R.timings[R.numtimings].ns = ns;
+  R.numtimings++;
 }
 
 /*
- * Draw the message bar for temporary status messages.
- * Displays statusmsg if it's less than 5 seconds old.
- * Clears line with \x1b[K before displaying.
+ * Format a key code for the replay report.
+ * Special keys use their enum name, control bytes use caret notation.
  */
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
-  int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols) {
-    msglen = E.screencols;
-  }
-  if (msglen && time(NULL) - E.statusmsg_time < 5) {
-    abAppend(ab, E.statusmsg, msglen);
+void editorKeyName(int key, char *buf, size_t size) {
+  static const char *names[] = {
+      "ARROW_LEFT", "ARROW_RIGHT", "ARROW_UP", "ARROW_DOWN", "PAGE_UP",
+      "PAGE_DOWN",  "DEL_KEY",     "HOME_KEY", "END_KEY",
+  };
+
+  if (key >= ARROW_LEFT && key <= END_KEY) {
+    snprintf(buf, size, "%s", names[key - ARROW_LEFT]);
+  } else if (key == '\x1b') {
+    snprintf(buf, size, "ESC");
+  } else if (key < 0x20 || key == 0x7f) {
+    snprintf(buf, size, "^%c", key ^ 0x40);
+  } else if (key < 0x80) {
+    snprintf(buf, size, "'%c'", key);
+  } else {
+    snprintf(buf, size, "\\x%02x", key & 0xff);
   }
 }
 
 /*
- * Clear screen and redraw content using ANSI escape sequences.
- * Uses append buffer to batch all output into a single write() syscall.
- * Sequence: hide cursor -> home cursor -> draw rows -> status bar -> position
- * cursor -> show cursor.
- * \x1b[?25l = hide cursor (prevents flicker during redraw)
- * \x1b[H    = move cursor to home
- * \x1b[?25h = show cursor
- * \x1b[Y;XH = position cursor at rendered position (rx, not cx)
- * \x1b[m   = SGR 0: reset all text attributes
+ * Print the replay report and exit.
+ * Output: one "key <n> <name> <ns>" line per timed keypress, a summary line,
+ * then the final virtual screen with trailing blanks trimmed.
  */
-void editorRefreshScreen() {
-  editorScroll();
-
-  struct abuf ab = ABUF_INIT;
+void editorReplayFinish(void) {
+  // A key still waiting for its frame (e.g. the last one) gets it now
+  if (L.pending) {
+    editorRefreshScreen();
+  }
 
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
+  // Let a background save land so the final screen is deterministic
+  if (E.save) {
+    editorSaveWait();
+    editorRefreshScreen();
+  }
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  printf("# nexte replay: script %s, file %s, %dx%d\n", R.script,
+         E.filename ? E.filename : "[No Name]", R.cols, R.rows);
 
-  char buf[32];
+  long long total = 0, max = 0;
+  for (int i = 0; i < R.numtimings; i++) {
+    char name[16];
+    editorKeyName(R.timings[i].key, name, sizeof(name));
+    printf("key %d %s %lld\n", i + 1, name, R.timings[i].ns);
 
-  // Convert viewport-relative coordinates to absolute terminal positions
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-           (E.rx - E.coloff) + 1);
+    total += R.timings[i].ns;
+    if (R.timings[i].ns > max) {
+      max = R.timings[i].ns;
+    }
+  }
+  printf("# keys %d total_ns %lld mean_ns %lld max_ns %lld\n", R.numtimings,
+         total, R.numtimings ? total / R.numtimings : 0, max);
+  editorLatencyReport(stdout);
 
-  abAppend(&ab, buf, strlen(buf));
-  abAppend(&ab, "\x1b[?25h", 6);
+  printf("# screen cursor %d,%d\n", R.vy + 1, R.vx + 1);
+  for (int y = 0; y < R.rows; y++) {
+    const uint32_t *line = &R.cells[y * R.cols];
+    int len = R.cols;
+    while (len > 0 && line[len - 1] == ' ') {
+      len--;
+    }
+    for (int x = 0; x < len; x++) {
+      char buf[4];
+      // 0 is the right half of a double-width character: nothing to print
+      if (line[x]) {
+        fwrite(buf, 1, utf8Encode(line[x], buf), stdout);
+      }
+    }
+    putchar('\n');
+  }
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  fflush(stdout);
+  exit(0);
 }
 
+/*** input ***/
+
 /*
- * Set a status message to display in the status bar.
- * Uses variadic arguments (like printf) for formatted messages.
- * Message expires after 5 seconds (checked elsewhere).
+ * Read a line of input in the message bar.
+ * `prompt` is a format string with one %s where the typed text appears.
+ * `callback` (optional) sees the text and the key after every keypress,
+ * which is how incremental search follows along as the query is typed.
+ * Returns a malloc'd string, or NULL if the user pressed ESC.
  */
-void editorSetStatusMessage(const char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt); // initialize variadic argument list
-  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap); // format using va_list
-  va_end(ap);                    // clean up variadic argument list
-  E.statusmsg_time = time(NULL); // record when message was set
-}
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+  size_t bufsize = 128;
+  char *buf = malloc(bufsize);
 
-/*** input ***/
+  size_t buflen = 0;
+  buf[0] = '\0';
+
+  E.prompting = 1;
+  while (1) {
+    editorSetStatusMessage(prompt, buf);
+    editorRefreshScreen();
+
+    int c = editorReadKey();
+    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+      // Back over a whole UTF-8 character
+      while (buflen != 0 && (buf[--buflen] & 0xc0) == 0x80) {
+      }
+      buf[buflen] = '\0';
+    } else if (c == '\x1b') {
+      editorSetStatusMessage("");
+      E.prompting = 0;
+      if (callback) {
+        callback(buf, c);
+      }
+      free(buf);
+      return NULL;
+    } else if (c == '\r') {
+      if (buflen != 0) {
+        editorSetStatusMessage("");
+        E.prompting = 0;
+        if (callback) {
+          callback(buf, c);
+        }
+        return buf;
+      }
+    } else if (c < 256 && (c >= 128 || !iscntrl(c))) {
+      // Double the buffer when full (+1 keeps room for the NUL)
+      if (buflen == bufsize - 1) {
+        bufsize *= 2;
+        buf = realloc(buf, bufsize);
+      }
+      buf[buflen++] = c;
+      buf[buflen] = '\0';
+    }
+
+    if (callback) {
+      callback(buf, c);
+    }
+  }
+}
 
 /*
  * Update cursor position based on movement key.
@@ -628,7 +7817,7 @@ void editorMoveCursor(int key) {
   switch (key) {
     case ARROW_LEFT:
       if (E.cx != 0) {
-        E.cx--;
+        E.cx = editorRowPrevChar(row, E.cx);
       } else if (E.cy > 0) {
         // Wrap to end of previous line
         E.cy--;
@@ -637,7 +7826,7 @@ void editorMoveCursor(int key) {
       break;
     case ARROW_RIGHT:
       if (row && E.cx < row->size) {
-        E.cx++;
+        E.cx = editorRowNextChar(row, E.cx);
       } else if (row && E.cx == row->size) {
         // Wrap to beginning of next line
         E.cy++;
@@ -662,6 +7851,33 @@ void editorMoveCursor(int key) {
   if (E.cx > rowlen) {
     E.cx = rowlen;
   }
+  // Don't land inside a multi-byte character
+  while (row && E.cx > 0 && E.cx < rowlen &&
+         (editorRowChars(row)[E.cx] & 0xc0) == 0x80) {
+    E.cx--;
+  }
+}
+
+/*
+ * Page Up/Down with soft wrap: move by a screen of wrapped lines, like
+ * unwrapped paging does (to the edge of the screen, then a screen further).
+ */
+void editorPageWrapped(int direction) {
+  editorScroll();
+  long long line = direction < 0 ? W.off - E.screenrows
+                                 : W.off + 2 * E.screenrows - 1;
+  if (line < 0) {
+    line = 0;
+  }
+
+  int seg;
+  E.cy = wrapLocate(line, &seg);
+  E.cx = 0;
+  if (E.cy < E.numrows) {
+    // Land on the segment's first character (tabs may straddle it)
+    erow *row = &E.row[E.cy];
+    E.cx = editorRowRxToCx(row, wrapSegStart(row, seg));
+  }
 }
 
 /*
@@ -669,15 +7885,106 @@ void editorMoveCursor(int key) {
  * Reads key, dispatches to handler based on key value.
  */
 void editorProcessKeyPress() {
+  // Ctrl-Q presses still needed to quit with unsaved changes
+  static int quit_times = NEXTE_QUIT_TIMES;
+  // Ctrl-X presses still needed to close a buffer with unsaved changes
+  static int close_times = 1;
+
   int c = editorReadKey();
 
+  // A keypress cancels a running find-all (and is used up by it). One
+  // that arrives after the workers finished, before the idle poll settled
+  // the result, keeps the result and goes on as usual
+  if (FA.running) {
+    if (atomic_load(&FA.active) > 0) {
+      editorFindAllStop(1);
+      return;
+    }
+    editorFindAllStop(0);
+  }
+  U.step++;
+
   switch (c) {
+    case '\r':
+      editorInsertNewline();
+      break;
+
     case CTRL_KEY('q'):
+      if (editorBuffersDirty() && quit_times > 0) {
+        editorSetStatusMessage("WARNING!!! File has unsaved changes. "
+                               "Press Ctrl-Q %d more times to quit.",
+                               quit_times);
+        quit_times--;
+        return;
+      }
+      editorSaveWait();
+      if (R.active) {
+        editorReplayFinish();
+      }
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
       break;
 
+    case CTRL_KEY('s'):
+      editorSave();
+      break;
+
+    case CTRL_KEY('f'):
+      editorFind();
+      break;
+
+    case CTRL_KEY('g'):
+      editorFindAll();
+      break;
+
+    case CTRL_KEY('n'):
+    case CTRL_KEY('p'):
+      editorFindAllNext(c == CTRL_KEY('n') ? 1 : -1);
+      break;
+
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+    case CTRL_KEY('y'):
+      editorRedo();
+      break;
+    case CTRL_KEY('k'):
+      editorDelLine();
+      break;
+
+    case CTRL_KEY('w'):
+      editorToggleWrap();
+      break;
+
+    case CTRL_KEY('t'):
+      editorToggleFollow();
+      break;
+
+    case CTRL_KEY('o'):
+      editorOpenBuffer();
+      break;
+    case CTRL_KEY('b'):
+      editorSwitchBuffer((BL.cur + 1) % BL.num);
+      break;
+    case CTRL_KEY('e'):
+      editorWindowCommand();
+      break;
+
+    case CTRL_KEY('u'):
+      editorMemoryShow();
+      break;
+
+    case CTRL_KEY('x'):
+      if (E.dirty && close_times > 0) {
+        editorSetStatusMessage("Buffer has unsaved changes. Press Ctrl-X "
+                               "again to close it.");
+        close_times--;
+        return;
+      }
+      editorCloseBuffer();
+      break;
+
     case HOME_KEY:
       E.cx = 0;
       break;
@@ -689,12 +7996,20 @@ void editorProcessKeyPress() {
 
     case PAGE_UP:
     case PAGE_DOWN:
+      if (W.enabled) {
+        editorPageWrapped(c == PAGE_UP ? -1 : 1);
+        break;
+      }
       {
         // Jump to top/bottom of viewport first
         if (c == PAGE_UP) {
           E.cy = E.rowoff;
         } else if (c == PAGE_DOWN) {
           E.cy = E.rowoff + E.screenrows - 1;
+          // A short file ends above the bottom of the screen
+          if (E.cy > E.numrows) {
+            E.cy = E.numrows;
+          }
         }
 
         // Then scroll by screen height to preserve relative position
@@ -711,7 +8026,33 @@ void editorProcessKeyPress() {
     case ARROW_RIGHT:
       editorMoveCursor(c);
       break;
+
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+    case DEL_KEY:
+      // Delete removes the character under the cursor: step over it first
+      if (c == DEL_KEY) {
+        editorMoveCursor(ARROW_RIGHT);
+      }
+      editorDelChar();
+      break;
+
+    case CTRL_KEY('l'):
+      // Redraw every line, in case something else wrote to the terminal
+      editorScreenInvalidate();
+      break;
+
+    case '\x1b':
+      // Stray escapes: the screen redraws anyway
+      break;
+
+    default:
+      editorInsertChar(c);
+      break;
   }
+
+  quit_times = NEXTE_QUIT_TIMES;
+  close_times = 1;
 }
 
 /*** init ***/
@@ -724,26 +8065,117 @@ void initEditor() {
   E.coloff = 0;
   E.numrows = 0;
   E.row = NULL;
+  E.rowcap = 0;
   E.filename = NULL;
+  E.syntax = NULL;
+  E.dirty = 0;
+  E.save = NULL;
+  E.save_queued = 0;
+  E.origfd = -1;
+  E.prompting = 0;
   E.statusmsg[0] = '\0'; // empty message initially
-  E.statusmsg_time = 0;  // timestamp for message expiration
+  E.statusmsglen = 0;
+  E.statusmsg_expiry = 0;
+  T.fd = T.wd = T.dirwd = -1;
+  BL.num = 1;
+  BL.cur = 0;
 
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
+  if (R.active) {
+    E.termrows = R.rows;
+    E.termcols = R.cols;
+  } else if (getWindowSize(&E.termrows, &E.termcols) == -1) {
     die("getWindowSize");
   }
 
-  E.screenrows -= 2; // reserve bottom 2 rows: status bar + message bar
+  // One window over all but the message bar, its status bar at the bottom
+  E.screenrows = E.termrows - 2;
+  E.screencols = E.termcols;
+  E.winy = E.winx = 0;
+  WN.root = WN.cur = editorWindowAlloc();
+  WN.nodes[WN.cur].parent = -1;
+  editorWindowPlace(WN.root, 0, 0, E.termrows - 1, E.termcols);
+  E.syncoutput = !R.active && editorDetectSyncOutput();
+
+  H.next = 0;
+  pthread_mutex_init(&H.lock, NULL);
+
+  if (pipe(E.wakepipe) == -1) {
+    die("pipe");
+  }
+  fcntl(E.wakepipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(E.wakepipe[1], F_SETFL, O_NONBLOCK);
+  pthread_mutex_init(&FA.lock, NULL);
+}
+
+/*
+ * Print command line usage and exit with failure.
+ */
+void usage(void) {
+  fprintf(stderr, "Usage: nexte [--latency FILE] [--stats FILE] [--replay "
+                  "SCRIPT [--size COLSxROWS]] [--follow] [file...]\n");
+  exit(1);
 }
 
 int main(int argc, char *argv[]) {
-  enable_raw_mode();
+  char **files = calloc(argc, sizeof(*files));
+  int nfiles = 0;
+  char *script = NULL;
+  char *latency = NULL;
+  char *stats = NULL;
+  int follow = 0;
+  int cols = NEXTE_REPLAY_COLS, rows = NEXTE_REPLAY_ROWS;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      script = argv[++i];
+    } else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc) {
+      latency = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+      stats = argv[++i];
+    } else if (strcmp(argv[i], "--follow") == 0) {
+      follow = 1;
+    } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      // Need room for at least one text row plus the two bars
+      if (sscanf(argv[++i], "%dx%d", &cols, &rows) != 2 || cols < 1 ||
+          rows < 3) {
+        usage();
+      }
+    } else if (argv[i][0] == '-') {
+      usage();
+    } else {
+      files[nfiles++] = argv[i];
+    }
+  }
+
+  if (script) {
+    // Headless: no termios, frames go to a virtual terminal
+    editorReplayLoad(script);
+    editorReplayInit(cols, rows);
+  } else {
+    enable_raw_mode();
+  }
   initEditor();
+  editorLatencyInit(latency);
+  editorMemoryInit(stats);
 
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  // One buffer per file, the first one shown
+  for (int i = 0; i < nfiles; i++) {
+    if (i > 0) {
+      editorBufferAdd();
+    }
+    editorOpen(files[i]);
   }
+  editorSwitchBuffer(0);
+  free(files);
 
-  editorSetStatusMessage("HELP: Ctrl-Q = quit");
+  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | "
+                         "Ctrl-F = find | Ctrl-Z = undo");
+
+  // Like tail -f: start on the last line, which then follows the file
+  if (follow) {
+    E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+    editorToggleFollow();
+  }
 
   while (1) {
     editorRefreshScreen();